@@ -0,0 +1,48 @@
+'use strict'
+
+// Measures the reply throughput of a running agent: a burst of requests for a
+// native function (no R evaluation involved) is published at once and the
+// time until all replies arrived is taken, hence mostly the agent's MQTT
+// reading and writing is measured.
+//
+// Usage: node throughput.js [requests] [broker] [domain] [agent]
+
+const mqtt = require('mqtt')
+
+const n = parseInt(process.argv[2] || '10000')
+const broker = process.argv[3] || 'mqtt://localhost:1883'
+const domain = process.argv[4] || 'test'
+const agent = process.argv[5] || 'agent1'
+
+const topic = `${domain}/${agent}/Session/__static__/native_summary`
+const replyTopic = `${domain}/bench/${process.pid}/reply`
+
+async function main () {
+  const client = mqtt.connect(broker)
+  await new Promise(resolve => client.on('connect', resolve))
+  await new Promise(resolve => client.subscribe(replyTopic, { qos: 1 }, resolve))
+  let received = 0
+  let errors = 0
+  const done = new Promise(resolve =>
+    client.on('message', (topic, message) => {
+      if (JSON.parse(message).e) errors++
+      if (++received === n) resolve()
+    })
+  )
+  const start = process.hrtime.bigint()
+  for (let i = 0; i < n; i++) {
+    client.publish(
+      topic,
+      JSON.stringify({ s: replyTopic, i: String(i), a: [[1, 2, 3, 4]] }),
+      { qos: 1 }
+    )
+  }
+  await done
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9
+  console.log(`replies       : ${received} (${errors} errors)`)
+  console.log(`duration      : ${seconds.toFixed(3)} s`)
+  console.log(`throughput    : ${(n / seconds).toFixed(0)} replies/s`)
+  client.end()
+}
+
+main()
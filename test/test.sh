@@ -26,6 +26,9 @@ cleanup () {
 trap 'cleanup ; printf "${RED}Tests Failed For Unexpected Reasons${NC}\n"'\
   HUP INT QUIT PIPE TERM
 
+# start from an empty agent state (sessions, jobs, instance registry)
+rm -rf fixtures/.vrpc
+
 # run the composed services
 docker-compose build && docker-compose -p ${PROJECT} up -d
 
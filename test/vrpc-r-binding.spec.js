@@ -3,6 +3,65 @@
 /* global describe, context, before, after, it */
 const { VrpcClient } = require('vrpc')
 const assert = require('assert')
+const crypto = require('crypto')
+const http = require('http')
+const mqtt = require('mqtt')
+
+const sleep = ms => new Promise(resolve => setTimeout(resolve, ms))
+
+// requests the docker engine (its socket is mounted into the test runner)
+function docker (method, path) {
+  return new Promise((resolve, reject) => {
+    const req = http.request(
+      { socketPath: '/var/run/docker.sock', method, path },
+      res => {
+        let body = ''
+        res.on('data', x => { body += x })
+        res.on('end', () => {
+          if (res.statusCode >= 300) reject(new Error(body))
+          else resolve(body ? JSON.parse(body) : null)
+        })
+      }
+    )
+    req.on('error', reject)
+    req.end()
+  })
+}
+
+async function containerId (service) {
+  const filters = encodeURIComponent(JSON.stringify({
+    label: [
+      'com.docker.compose.project=test',
+      `com.docker.compose.service=${service}`
+    ]
+  }))
+  const [container] = await docker('GET', `/containers/json?filters=${filters}`)
+  return container.Id
+}
+
+// publishes a request without the vrpc client, replies are collected by id
+async function rawRequester (options = {}) {
+  const requester = mqtt.connect('mqtt://broker:1883', options)
+  await new Promise(resolve => requester.once('connect', resolve))
+  await new Promise(resolve =>
+    requester.subscribe('test/raw/reply', { qos: 1 }, resolve)
+  )
+  const replies = {}
+  requester.on('message', (topic, message) => {
+    const j = JSON.parse(message)
+    if (replies[j.i]) replies[j.i](j)
+  })
+  requester.request = (functionName, i, args) => {
+    const reply = new Promise(resolve => { replies[i] = resolve })
+    requester.publish(
+      `test/agent1/Session/__static__/${functionName}`,
+      JSON.stringify({ s: 'test/raw/reply', i, a: args }),
+      { qos: 1 }
+    )
+    return reply
+  }
+  return requester
+}
 
 describe('VRPC R-Agent', () => {
   let client
@@ -16,10 +75,12 @@ describe('VRPC R-Agent', () => {
   describe('Auto Discovery', () => {
     it('should correctly produce all discovery information', async () => {
       const agentInfo = new Promise(resolve =>
-        client.on('agent', ({ status, hostname, version }) => {
+        client.on('agent', ({ status, hostname, version, sharedContextSize, concurrencyLimit }) => {
           assert.strictEqual(status, 'online')
           assert.strictEqual(hostname, 'agent1')
           assert.strictEqual(version, '')
+          assert(sharedContextSize > 0)
+          assert(concurrencyLimit >= 2)
           resolve()
         })
       )
@@ -36,6 +97,7 @@ describe('VRPC R-Agent', () => {
               assert(x.includes('test_plot'))
               assert(x.includes('call'))
             }
+            assert(staticFunctions.includes('native_summary'))
             resolve()
           }
         )
@@ -135,6 +197,172 @@ describe('VRPC R-Agent', () => {
       assert(duration < 1000)
       assert.deepStrictEqual(ret, [0.8, 0.7])
     })
+    it('should map a function over a list using parallel chunks', async () => {
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__map__',
+        args: ['sqrt', [1, 4, 9, 16, 25, 36, 49], 2]
+      })
+      assert.deepStrictEqual(ret, [1, 2, 3, 4, 5, 6, 7])
+    })
+    it('should execute map chunks in parallel', async () => {
+      const start = Date.now()
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__map__',
+        args: ['test_sys_sleep', [0.8, 0.7], 1]
+      })
+      assert(Date.now() - start < 1500)
+      assert.deepStrictEqual(ret, [0.8, 0.7])
+    })
+    it('should execute pipelines of calls in a single request', async () => {
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__pipeline__',
+        args: [{
+          steps: [
+            { id: 'avg', f: 'mean', a: ['$values'] },
+            { id: 'values', f: 'c', a: [-2, -1, 0, 2, 6] },
+            { id: 'total', f: 'sum', a: ['$values'] },
+            { id: 'both', f: 'c', a: ['$avg', '$total'] }
+          ],
+          outputs: ['avg', 'both']
+        }]
+      })
+      assert.deepStrictEqual(ret, { avg: 1, both: [1, 5] })
+    })
+    it('should report the failing step of a pipeline', async () => {
+      await assert.rejects(
+        async () =>
+          client.callStatic({
+            className: 'Session',
+            functionName: '__pipeline__',
+            args: [{ steps: [{ id: 'x', f: 'does_not_exist', a: [] }] }]
+          }),
+        err => {
+          assert(err.message.includes('step x: could not find function'))
+          return true
+        }
+      )
+    })
+    it('should provide read-only access to the shared context', async () => {
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: 'get_lookup',
+        args: ['b']
+      })
+      assert.strictEqual(ret, 2)
+      await assert.rejects(async () =>
+        client.callStatic({
+          className: 'Session',
+          functionName: 'set_lookup',
+          args: ['b', 3]
+        })
+      )
+    })
+    it('should pass uploaded blobs as arguments', async () => {
+      const upload = () => client.callStatic({
+        className: 'Session',
+        functionName: '__upload__',
+        args: [[1, 2, 3, 4]]
+      })
+      const hash = await upload()
+      assert.match(hash, /^[0-9a-f]{40}$/)
+      assert.strictEqual(await upload(), hash)
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: 'call',
+        args: ['length', { __blob__: hash }]
+      })
+      assert.strictEqual(ret, 4)
+    })
+    it('should execute calls whose arguments are uploaded in chunks', async () => {
+      const payload = Buffer.from(JSON.stringify(['length', [1, 2, 3, 4, 5]]))
+      const sha1 = crypto.createHash('sha1').update(payload).digest('hex')
+      const chunks = [payload.slice(0, 10), payload.slice(10, 20), payload.slice(20)]
+      let ret
+      for (let i = 0; i < chunks.length; i++) {
+        ret = await client.callStatic({
+          className: 'Session',
+          functionName: '__callChunk__',
+          args: ['upload1', i, chunks.length, chunks[i].toString('base64'), 'call', sha1]
+        })
+        if (i < chunks.length - 1) assert.deepStrictEqual(ret, { received: i })
+      }
+      assert.strictEqual(ret, 5)
+    })
+    it('should call native functions without R evaluation', async () => {
+      const histogram = await client.callStatic({
+        className: 'Session',
+        functionName: 'native_histogram',
+        args: [[1, 2, 2, 3, 10], 3]
+      })
+      assert.deepStrictEqual(histogram, { breaks: [1, 4, 7, 10], counts: [4, 0, 1] })
+      const summary = await client.callStatic({
+        className: 'Session',
+        functionName: 'native_summary',
+        args: [[1, 2, 3, 4]]
+      })
+      assert.strictEqual(summary.n, 4)
+      assert.strictEqual(summary.q1, 1.75)
+      assert.strictEqual(summary.median, 2.5)
+      assert.strictEqual(summary.max, 4)
+    })
+    it('should drop requests whose deadline passed', async () => {
+      const metrics = () => client.callStatic({
+        className: 'Session',
+        functionName: '__metrics__',
+        args: []
+      })
+      const before = await metrics()
+      // the deadline is part of the request envelope
+      const requester = mqtt.connect('mqtt://broker:1883')
+      await new Promise(resolve => requester.on('connect', resolve))
+      await new Promise(resolve => requester.subscribe('test/deadline/reply', resolve))
+      const reply = new Promise(resolve =>
+        requester.on('message', (topic, message) => resolve(JSON.parse(message)))
+      )
+      requester.publish(
+        'test/agent1/Session/__static__/test_sys_sleep',
+        JSON.stringify({ s: 'test/deadline/reply', i: '1', a: [0.1], d: Date.now() - 1000 })
+      )
+      assert.strictEqual((await reply).e, 'Error while calling remote function: Deadline exceeded')
+      requester.end()
+      const after = await metrics()
+      assert.strictEqual(after.dropped, before.dropped + 1)
+    })
+    it('should stream stdout and stderr to the log topic', async () => {
+      const requester = mqtt.connect('mqtt://broker:1883')
+      await new Promise(resolve => requester.on('connect', resolve))
+      await new Promise(resolve => requester.subscribe('test/agent1/__log__/log1', resolve))
+      await new Promise(resolve => requester.subscribe('test/log/reply', resolve))
+      const lines = []
+      const reply = new Promise(resolve =>
+        requester.on('message', (topic, message) => {
+          if (topic === 'test/log/reply') resolve(JSON.parse(message))
+          else lines.push(message.toString())
+        })
+      )
+      requester.publish(
+        'test/agent1/Session/__static__/test_log',
+        JSON.stringify({ s: 'test/log/reply', i: 'log1', a: [] })
+      )
+      assert.strictEqual((await reply).r, true)
+      await new Promise(resolve => setTimeout(resolve, 200))
+      const output = lines.join('')
+      assert(output.includes('to stdout'))
+      assert(output.includes('to stderr'))
+      assert(output.includes('Warning: careful'))
+      requester.end()
+    })
+    it('should reload unchanged functions without any changes', async () => {
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__reload__',
+        args: []
+      })
+      assert.deepStrictEqual(ret, { added: [], removed: [] })
+    })
     it('should support calling of external package functionality', async () => {
       const ret = await client.callStatic({
         className: 'Session',
@@ -148,6 +376,49 @@ describe('VRPC R-Agent', () => {
       )
     })
   })
+  describe('Asynchronous jobs', () => {
+    it('should immediately return a job id and later the result', async () => {
+      const id = await client.callStatic({
+        className: 'Session',
+        functionName: '__submitJob__',
+        args: ['test_sys_sleep', 0.5]
+      })
+      assert.strictEqual(typeof id, 'string')
+      const { status } = await client.callStatic({
+        className: 'Session',
+        functionName: '__jobStatus__',
+        args: [id]
+      })
+      assert.strictEqual(status, 'running')
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__jobResult__',
+        args: [id]
+      })
+      assert.strictEqual(ret, 0.5)
+      const info = await client.callStatic({
+        className: 'Session',
+        functionName: '__jobStatus__',
+        args: [id]
+      })
+      assert.strictEqual(info.status, 'done')
+      assert(info.finished >= info.created)
+    })
+    it('should report errors of failed jobs', async () => {
+      const id = await client.callStatic({
+        className: 'Session',
+        functionName: '__submitJob__',
+        args: ['does_not_exist']
+      })
+      await assert.rejects(async () =>
+        client.callStatic({
+          className: 'Session',
+          functionName: '__jobResult__',
+          args: [id]
+        })
+      )
+    })
+  })
   describe('Member function calls', () => {
     let proxy1
     let proxy2
@@ -163,6 +434,29 @@ describe('VRPC R-Agent', () => {
       assert.strictEqual(typeof proxy1, 'object')
       assert.strictEqual(typeof proxy2, 'object')
     })
+    it('should pass constructor arguments to the init function', async () => {
+      const proxy = await client.create({
+        className: 'Session',
+        instance: 'session5',
+        args: ['rock']
+      })
+      const rockRow = await proxy.get_table(1)
+      assert.deepStrictEqual(rockRow, [
+        { area: 4990, peri: 2791.9, perm: 6.3, shape: 0.0903 }
+      ])
+    })
+    it('should not create instances whose init function fails', async () => {
+      // a retry must not take over a snapshot left by the failed init
+      for (let i = 0; i < 2; i++) {
+        await assert.rejects(async () =>
+          client.create({
+            className: 'Session',
+            instance: 'session6',
+            args: ['rock', 'unused']
+          })
+        )
+      }
+    })
     it('should allow generic calls on that instance', async () => {
       const ret = await proxy1.call('c', -2, -1, 0, 2, 6)
       assert(Array.isArray(ret))
@@ -190,6 +484,10 @@ describe('VRPC R-Agent', () => {
         { dist: 10, speed: 4 }
       ])
     })
+    it('should keep memory mapped vectors in the session', async () => {
+      assert.strictEqual(await proxy2.map_column(), 1000)
+      assert.strictEqual(await proxy2.sum_column(), 500500)
+    })
     it('should cleanly separate state of different instances', async () => {
       assert(await proxy1.select_dataset('pressure'))
       const pressureRow = await proxy1.get_table(1)
@@ -200,10 +498,178 @@ describe('VRPC R-Agent', () => {
       ])
       assert.deepStrictEqual(carRow, [{ dist: 2, speed: 4 }])
     })
+    it('should clone instances from templates and other instances', async () => {
+      const ret = await client.callStatic({
+        className: 'Session',
+        functionName: '__clone__',
+        args: ['session3', 'cars']
+      })
+      assert.strictEqual(ret, 'session3')
+      const proxy3 = await client.getInstance('session3')
+      assert.deepStrictEqual(await proxy3.get_table(1), [{ dist: 2, speed: 4 }])
+      await client.callStatic({
+        className: 'Session',
+        functionName: '__clone__',
+        args: ['session4', 'session1']
+      })
+      const proxy4 = await client.getInstance('session4')
+      assert.deepStrictEqual(await proxy4.get_table(1), [
+        { pressure: 0.0002, temperature: 0 }
+      ])
+      assert(await proxy4.select_dataset('rock'))
+      assert.deepStrictEqual(await proxy1.get_table(1), [
+        { pressure: 0.0002, temperature: 0 }
+      ])
+    })
+    it('should migrate sessions using chunked export and import', async () => {
+      const manifest = await client.callStatic({
+        className: 'Session',
+        functionName: '__exportSession__',
+        args: ['session2']
+      })
+      assert.strictEqual(manifest.instance, 'session2')
+      for (let i = 0; i < manifest.chunks; i++) {
+        const data = await client.callStatic({
+          className: 'Session',
+          functionName: '__exportChunk__',
+          args: ['session2', i]
+        })
+        const { complete } = await client.callStatic({
+          className: 'Session',
+          functionName: '__importChunk__',
+          args: ['session2b', i, manifest.chunks, data, manifest.md5]
+        })
+        assert.strictEqual(complete, i === manifest.chunks - 1)
+      }
+      const proxy = await client.getInstance('session2b')
+      assert.deepStrictEqual(await proxy.get_table(1), [{ dist: 2, speed: 4 }])
+    })
+    it('should migrate sessions larger than a single chunk', async () => {
+      const proxy = await client.create({
+        className: 'Session',
+        instance: 'session8'
+      })
+      assert.strictEqual(await proxy.fill_noise(100000), 100000)
+      const manifest = await client.callStatic({
+        className: 'Session',
+        functionName: '__exportSession__',
+        args: ['session8']
+      })
+      assert(manifest.chunks > 1)
+      for (let i = 0; i < manifest.chunks; i++) {
+        const data = await client.callStatic({
+          className: 'Session',
+          functionName: '__exportChunk__',
+          args: ['session8', i]
+        })
+        const { complete } = await client.callStatic({
+          className: 'Session',
+          functionName: '__importChunk__',
+          args: ['session8b', i, manifest.chunks, data, manifest.md5]
+        })
+        assert.strictEqual(complete, i === manifest.chunks - 1)
+      }
+      const imported = await client.getInstance('session8b')
+      assert.strictEqual(await imported.noise_length(), 100000)
+    })
+    it('should append streamed data to a data frame of the session', async () => {
+      const proxy = await client.create({
+        className: 'Session',
+        instance: 'session7'
+      })
+      assert(await proxy.__ingest__('test/sensors/+', 'readings'))
+      const publisher = mqtt.connect('mqtt://broker:1883')
+      await new Promise(resolve => publisher.on('connect', resolve))
+      publisher.publish('test/sensors/a', JSON.stringify({ t: 1, value: 0.5 }))
+      publisher.publish('test/sensors/b', JSON.stringify([{ t: 2, value: 0.7 }, { t: 3 }]))
+      await new Promise(resolve => setTimeout(resolve, 500))
+      publisher.end()
+      assert.strictEqual(await proxy.__flush__(), 3)
+      assert.strictEqual(await proxy.count_readings(), 3)
+    })
     it('should delete proxies', async () => {
       const ret = await client.delete('session1')
       assert.strictEqual(ret, true)
       assert.rejects(async () => await proxy1.get_table(1))
     })
   })
+  describe('Restarts', () => {
+    // retries until the (restarted) agent serves requests again
+    const waitForAgent = async () => {
+      for (let i = 0; i < 100; i++) {
+        try {
+          return await client.callStatic({
+            className: 'Session',
+            functionName: 'native_summary',
+            args: [[1]]
+          })
+        } catch (err) {
+          await sleep(300)
+        }
+      }
+      throw new Error('Agent did not come back')
+    }
+    it('should finish accepted calls and keep instances and jobs', async function () {
+      this.timeout(60000)
+      const requester = await rawRequester()
+      const call = requester.request('test_sys_sleep', 'drain1', [1])
+      const jobId = await client.callStatic({
+        className: 'Session',
+        functionName: '__submitJob__',
+        args: ['test_sys_sleep', 1.5]
+      })
+      await sleep(300)
+      // SIGTERM drains the agent, calls accepted before are still replied
+      const restart = docker(
+        'POST',
+        `/containers/${await containerId('agent1')}/restart?t=30`
+      )
+      assert.strictEqual((await call).r, 1)
+      await restart
+      requester.end()
+      await waitForAgent()
+      const proxy4 = await client.getInstance('session4')
+      assert.deepStrictEqual(await proxy4.get_table(1), [
+        { area: 4990, peri: 2791.9, perm: 6.3, shape: 0.0903 }
+      ])
+      const proxy8b = await client.getInstance('session8b')
+      assert.strictEqual(await proxy8b.noise_length(), 100000)
+      await assert.rejects(async () =>
+        client.callStatic({
+          className: 'Session',
+          functionName: '__clone__',
+          args: ['session9', 'session1']
+        })
+      )
+      const { status } = await client.callStatic({
+        className: 'Session',
+        functionName: '__jobStatus__',
+        args: [jobId]
+      })
+      assert.strictEqual(status, 'done')
+      assert.strictEqual(
+        await client.callStatic({
+          className: 'Session',
+          functionName: '__jobResult__',
+          args: [jobId]
+        }),
+        1.5
+      )
+    })
+    it('should reconnect and deliver spooled replies after a broker outage', async function () {
+      this.timeout(60000)
+      const requester = await rawRequester({ reconnectPeriod: 100 })
+      const call = requester.request('test_sys_sleep', 'spool1', [2])
+      await sleep(300)
+      const broker = await containerId('broker')
+      await docker('POST', `/containers/${broker}/stop?t=0`)
+      // the reply is spooled as the call finishes while the broker is down
+      await sleep(3000)
+      await docker('POST', `/containers/${broker}/start`)
+      assert.strictEqual((await call).r, 2)
+      const summary = await requester.request('native_summary', 'spool2', [[1, 2]])
+      assert.strictEqual(summary.r.n, 2)
+      requester.end()
+    })
+  })
 })
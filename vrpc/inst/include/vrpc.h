@@ -0,0 +1,41 @@
+// Native functions of the vrpc agent
+//
+// Packages listing vrpc in `LinkingTo` can register C++ functions that the
+// agent calls directly, without forking and without R evaluation. Arguments
+// and result are the JSON payloads of the request and reply:
+//
+//   vrpc::json scale(const vrpc::json& args) {
+//     vrpc::json result = vrpc::json::array();
+//     for (const auto& x : args[0]) result.push_back(x.get<double>() * 2);
+//     return result;
+//   }
+//
+//   // e.g. within the package's R_init function
+//   vrpc::register_native("scale", scale);
+//
+// Functions must be registered before the agent is started. Pooled functions
+// run on the agent's thread pool (see `native_threads`) and must not use the
+// R API, thrown exceptions are replied as errors.
+
+#ifndef VRPC_H
+#define VRPC_H
+
+#include <R_ext/Rdynload.h>
+#include <json.hpp>
+
+namespace vrpc {
+
+typedef json (*native_function)(const json& args);
+
+inline void register_native(const char* name,
+                            native_function function,
+                            bool pooled = true) {
+  typedef void (*register_native_t)(const char*, native_function, int);
+  static const auto registrar = reinterpret_cast<register_native_t>(
+      R_GetCCallable("vrpc", "register_native_function"));
+  registrar(name, function, pooled);
+}
+
+}  // namespace vrpc
+
+#endif
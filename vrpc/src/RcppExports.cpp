@@ -10,6 +10,37 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// mmap_vector
+SEXP mmap_vector(const std::string& path, const std::string& type);
+RcppExport SEXP _vrpc_mmap_vector(SEXP pathSEXP, SEXP typeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type type(typeSEXP);
+    rcpp_result_gen = Rcpp::wrap(mmap_vector(path, type));
+    return rcpp_result_gen;
+END_RCPP
+}
+// start_output_stream
+void start_output_stream(int id);
+RcppExport SEXP _vrpc_start_output_stream(SEXP idSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type id(idSEXP);
+    start_output_stream(id);
+    return R_NilValue;
+END_RCPP
+}
+// stop_output_stream
+void stop_output_stream();
+RcppExport SEXP _vrpc_stop_output_stream() {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    stop_output_stream();
+    return R_NilValue;
+END_RCPP
+}
 // on_execution_done
 void on_execution_done(int id, const Rcpp::CharacterVector& cv);
 RcppExport SEXP _vrpc_on_execution_done(SEXP idSEXP, SEXP cvSEXP) {
@@ -21,6 +52,28 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// lock_session
+int lock_session(const std::string& session_dir, bool wait);
+RcppExport SEXP _vrpc_lock_session(SEXP session_dirSEXP, SEXP waitSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type session_dir(session_dirSEXP);
+    Rcpp::traits::input_parameter< bool >::type wait(waitSEXP);
+    rcpp_result_gen = Rcpp::wrap(lock_session(session_dir, wait));
+    return rcpp_result_gen;
+END_RCPP
+}
+// unlock_session
+void unlock_session(int fd);
+RcppExport SEXP _vrpc_unlock_session(SEXP fdSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type fd(fdSEXP);
+    unlock_session(fd);
+    return R_NilValue;
+END_RCPP
+}
 // start_vrpc_agent
 void start_vrpc_agent(const Rcpp::List& args);
 RcppExport SEXP _vrpc_start_vrpc_agent(SEXP argsSEXP) {
@@ -31,14 +84,33 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// stop_vrpc_agent
+void stop_vrpc_agent();
+RcppExport SEXP _vrpc_stop_vrpc_agent() {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    stop_vrpc_agent();
+    return R_NilValue;
+END_RCPP
+}
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_vrpc_mmap_vector", (DL_FUNC) &_vrpc_mmap_vector, 2},
+    {"_vrpc_start_output_stream", (DL_FUNC) &_vrpc_start_output_stream, 1},
+    {"_vrpc_stop_output_stream", (DL_FUNC) &_vrpc_stop_output_stream, 0},
     {"_vrpc_on_execution_done", (DL_FUNC) &_vrpc_on_execution_done, 2},
+    {"_vrpc_lock_session", (DL_FUNC) &_vrpc_lock_session, 2},
+    {"_vrpc_unlock_session", (DL_FUNC) &_vrpc_unlock_session, 1},
     {"_vrpc_start_vrpc_agent", (DL_FUNC) &_vrpc_start_vrpc_agent, 1},
+    {"_vrpc_stop_vrpc_agent", (DL_FUNC) &_vrpc_stop_vrpc_agent, 0},
     {NULL, NULL, 0}
 };
 
+void init_altrep_mmap(DllInfo* dll);
+void init_native_functions(DllInfo* dll);
 RcppExport void R_init_vrpc(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    init_altrep_mmap(dll);
+    init_native_functions(dll);
 }
@@ -0,0 +1,280 @@
+// Read-only datasets as memory mapped ALTREP vectors
+//
+// A binary column file (native doubles or integers) is mapped instead of being
+// read, hence nothing is deserialized and the pages are shared through the
+// page cache by all sessions and forked workers using the same file. Mappings
+// are private, pages that get written to are copied for the writing process
+// only and the file itself is never changed. A mapped vector is serialized as
+// the path and identity (inode, size, modification time) of its file, which
+// must still match when it is mapped again.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <Rcpp.h>
+#if R_VERSION < R_Version(3, 6, 0)
+// older headers of R use `class` as identifier and lack C linkage
+#define class klass
+extern "C" {
+#include <R_ext/Altrep.h>
+}
+#undef class
+#else
+#include <R_ext/Altrep.h>
+#endif
+
+namespace {
+
+R_altrep_class_t mmap_real_class;
+R_altrep_class_t mmap_integer_class;
+
+struct Mapping {
+  void* addr;
+  std::size_t size;
+  // R asks for a writeable pointer also for reading and duplicating, hence
+  // this only means the data may have been changed in place
+  bool modified;
+  // identity of the mapped file
+  std::string identity;
+};
+
+std::string file_identity(const struct stat& info) {
+  char identity[96];
+  std::snprintf(identity, sizeof(identity), "%llu:%lld:%lld.%09ld",
+                static_cast<unsigned long long>(info.st_ino),
+                static_cast<long long>(info.st_size),
+                static_cast<long long>(info.st_mtim.tv_sec),
+                static_cast<long>(info.st_mtim.tv_nsec));
+  return identity;
+}
+
+std::size_t element_size(int type) {
+  return type == REALSXP ? sizeof(double) : sizeof(int);
+}
+
+// maps a file, returns an error message on failure
+const char* map_file(const char* path, int type, Mapping* mapping) {
+  static char message[512];
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    std::snprintf(message, sizeof(message), "Failed opening %s: %s", path,
+                  std::strerror(errno));
+    return message;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    std::snprintf(message, sizeof(message), "Failed reading %s: %s", path,
+                  std::strerror(errno));
+    ::close(fd);
+    return message;
+  }
+  mapping->size = info.st_size;
+  mapping->modified = false;
+  mapping->identity = file_identity(info);
+  if (mapping->size % element_size(type) != 0) {
+    std::snprintf(message, sizeof(message),
+                  "Size of %s is no multiple of the element size", path);
+    ::close(fd);
+    return message;
+  }
+  mapping->addr = nullptr;
+  if (mapping->size > 0) {
+    mapping->addr = mmap(nullptr, mapping->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (mapping->addr == MAP_FAILED) {
+    std::snprintf(message, sizeof(message), "Failed mapping %s: %s", path,
+                  std::strerror(errno));
+    return message;
+  }
+  return nullptr;
+}
+
+void finalize_mapping(SEXP ptr) {
+  auto* mapping = static_cast<Mapping*>(R_ExternalPtrAddr(ptr));
+  if (mapping == nullptr) return;
+  if (mapping->size > 0) munmap(mapping->addr, mapping->size);
+  delete mapping;
+  R_ClearExternalPtr(ptr);
+}
+
+// data1 holds the mapping, data2 the path of the mapped file
+SEXP make_vector(const Mapping& mapping, int type, SEXP path) {
+  if (mapping.size == 0) return Rf_allocVector(type, 0);
+  SEXP ptr = PROTECT(R_MakeExternalPtr(new Mapping(mapping), R_NilValue,
+                                       R_NilValue));
+  R_RegisterCFinalizerEx(ptr, finalize_mapping, TRUE);
+  SEXP x = R_new_altrep(type == REALSXP ? mmap_real_class : mmap_integer_class,
+                        ptr, path);
+  UNPROTECT(1);
+  return x;
+}
+
+Mapping* get_mapping(SEXP x) {
+  return static_cast<Mapping*>(R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+// -- ALTREP methods --
+
+R_xlen_t mmap_length(SEXP x) {
+  return get_mapping(x)->size / element_size(TYPEOF(x));
+}
+
+void* mmap_dataptr(SEXP x, Rboolean writeable) {
+  Mapping* mapping = get_mapping(x);
+  if (writeable) mapping->modified = true;
+  return mapping->addr;
+}
+
+const void* mmap_dataptr_or_null(SEXP x) {
+  return get_mapping(x)->addr;
+}
+
+double mmap_real_elt(SEXP x, R_xlen_t i) {
+  return static_cast<const double*>(get_mapping(x)->addr)[i];
+}
+
+int mmap_integer_elt(SEXP x, R_xlen_t i) {
+  return static_cast<const int*>(get_mapping(x)->addr)[i];
+}
+
+template <class T>
+R_xlen_t mmap_get_region(SEXP x, R_xlen_t i, R_xlen_t n, T* buf) {
+  const R_xlen_t length = mmap_length(x);
+  const R_xlen_t count = i + n > length ? length - i : n;
+  std::memcpy(buf, static_cast<const T*>(get_mapping(x)->addr) + i,
+              count * sizeof(T));
+  return count;
+}
+
+R_xlen_t mmap_real_get_region(SEXP x, R_xlen_t i, R_xlen_t n, double* buf) {
+  return mmap_get_region(x, i, n, buf);
+}
+
+R_xlen_t mmap_integer_get_region(SEXP x, R_xlen_t i, R_xlen_t n, int* buf) {
+  return mmap_get_region(x, i, n, buf);
+}
+
+// whether the file at `path` is still the mapped one and, if the mapping may
+// have been written to, holds the same data
+bool matches_file(const Mapping& mapping, const char* path) {
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  bool matches =
+      fstat(fd, &info) == 0 && file_identity(info) == mapping.identity;
+  if (matches && mapping.modified) {
+    // the file's pages are mostly in the page cache already
+    void* addr = mmap(nullptr, mapping.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    matches = addr != MAP_FAILED &&
+              std::memcmp(addr, mapping.addr, mapping.size) == 0;
+    if (addr != MAP_FAILED) munmap(addr, mapping.size);
+  }
+  ::close(fd);
+  return matches;
+}
+
+// vectors matching their file are serialized as its path and identity (e.g.
+// when saving a session), all others as ordinary vectors
+SEXP mmap_serialized_state(SEXP x) {
+  const Mapping* mapping = get_mapping(x);
+  SEXP path = R_altrep_data2(x);
+  if (!matches_file(*mapping, CHAR(STRING_ELT(path, 0)))) return NULL;
+  SEXP state = PROTECT(Rf_allocVector(STRSXP, 2));
+  SET_STRING_ELT(state, 0, STRING_ELT(path, 0));
+  SET_STRING_ELT(state, 1, Rf_mkChar(mapping->identity.c_str()));
+  UNPROTECT(1);
+  return state;
+}
+
+SEXP mmap_unserialize(SEXP state, int type) {
+  const char* path = CHAR(STRING_ELT(state, 0));
+  Mapping mapping;
+  const char* error = map_file(path, type, &mapping);
+  if (error != nullptr) Rf_error("%s", error);
+  // states of older snapshots hold the path only
+  if (XLENGTH(state) > 1 &&
+      mapping.identity != CHAR(STRING_ELT(state, 1))) {
+    if (mapping.size > 0) munmap(mapping.addr, mapping.size);
+    Rf_error("Mapped file %s was replaced after the session was saved", path);
+  }
+  SEXP path_sexp = PROTECT(Rf_ScalarString(STRING_ELT(state, 0)));
+  SEXP x = make_vector(mapping, type, path_sexp);
+  UNPROTECT(1);
+  return x;
+}
+
+SEXP mmap_real_unserialize(SEXP, SEXP state) {
+  return mmap_unserialize(state, REALSXP);
+}
+
+SEXP mmap_integer_unserialize(SEXP, SEXP state) {
+  return mmap_unserialize(state, INTSXP);
+}
+
+Rboolean mmap_inspect(SEXP x, int, int, int, void (*)(SEXP, int, int, int)) {
+  Rprintf(" mmap %s (%s)\n", CHAR(STRING_ELT(R_altrep_data2(x), 0)),
+          get_mapping(x)->modified ? "modified" : "unmodified");
+  return TRUE;
+}
+
+template <class T>
+void set_common_methods(T cls) {
+  R_set_altrep_Length_method(cls, mmap_length);
+  R_set_altrep_Inspect_method(cls, mmap_inspect);
+  R_set_altrep_Serialized_state_method(cls, mmap_serialized_state);
+  R_set_altvec_Dataptr_method(cls, mmap_dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, mmap_dataptr_or_null);
+}
+
+}  // namespace
+
+// [[Rcpp::init]]
+void init_altrep_mmap(DllInfo* dll) {
+  mmap_real_class = R_make_altreal_class("mmap_real", "vrpc", dll);
+  set_common_methods(mmap_real_class);
+  R_set_altrep_Unserialize_method(mmap_real_class, mmap_real_unserialize);
+  R_set_altreal_Elt_method(mmap_real_class, mmap_real_elt);
+  R_set_altreal_Get_region_method(mmap_real_class, mmap_real_get_region);
+
+  mmap_integer_class = R_make_altinteger_class("mmap_integer", "vrpc", dll);
+  set_common_methods(mmap_integer_class);
+  R_set_altrep_Unserialize_method(mmap_integer_class,
+                                  mmap_integer_unserialize);
+  R_set_altinteger_Elt_method(mmap_integer_class, mmap_integer_elt);
+  R_set_altinteger_Get_region_method(mmap_integer_class,
+                                     mmap_integer_get_region);
+}
+
+// [[Rcpp::export]]
+SEXP mmap_vector(const std::string& path, const std::string& type = "double") {
+  int sexp_type;
+  if (type == "double") {
+    sexp_type = REALSXP;
+  } else if (type == "integer") {
+    sexp_type = INTSXP;
+  } else {
+    Rcpp::stop("Unsupported type: " + type);
+  }
+  // the absolute path is kept, sessions evaluate in different directories
+  char* resolved = realpath(path.c_str(), nullptr);
+  if (resolved == nullptr) Rcpp::stop("Failed opening " + path);
+  const std::string absolute(resolved);
+  std::free(resolved);
+  Mapping mapping;
+  const char* error = map_file(absolute.c_str(), sexp_type, &mapping);
+  if (error != nullptr) Rcpp::stop(error);
+  SEXP state = PROTECT(Rf_mkString(absolute.c_str()));
+  SEXP x = make_vector(mapping, sexp_type, state);
+  UNPROTECT(1);
+  return x;
+}
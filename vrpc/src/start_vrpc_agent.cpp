@@ -1,17 +1,53 @@
 
 // [[Rcpp::depends(BH)]]
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
 
+#include <R_ext/eventloop.h>
 #include <Rcpp.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/archive/iterators/binary_from_base64.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+#include <boost/uuid/detail/sha1.hpp>
 #include <json.hpp>
 #include <mqtt_client_cpp.hpp>
+#include <vrpc.h>
 
 #define VRPC_PROTOCOL_VERSION 3
 
+// session id prefix under which session templates are stored
+#define VRPC_TEMPLATE_PREFIX "__template__"
+
 using namespace std::chrono_literals;
 
 struct Options {
@@ -25,15 +61,86 @@ struct Options {
   std::string token;
   std::string version;
   std::vector<std::string> functions;
+  std::string state_dir;
+  std::string socket;
+  int job_ttl;
+  std::string init;
+  double shared_size;
+  std::string source;
+  int watch;
+  int blob_ttl;
+  double blob_budget;
+  double spool_size;
+  int native_threads;
+  int max_concurrency;
+  int drain_timeout;
+  bool background;
+};
+
+// kinds of messages sent from a detached R evaluation back to the agent
+enum class MessageType : std::uint32_t { result = 0, output = 1 };
+
+// header of each message sent from a detached R evaluation back to the agent
+struct ResultHeader {
+  std::int32_t id;
+  MessageType type;
+  std::uint64_t size;
+};
+
+// asynchronous job, its result is persisted below `<state_dir>/jobs`
+struct Job {
+  std::string status;  // queued, running, done or failed
+  vrpc::json request;
+  std::int64_t created;
+  std::int64_t finished;
+  // pending __jobResult__ requests, answered as soon as the job finishes
+  std::vector<vrpc::json> waiters;
+};
+
+// arguments of a call that are uploaded in several chunks
+struct Upload {
+  int next;  // index of the expected chunk
+  boost::uuids::detail::sha1 sha1;
+  std::ofstream file;
+  std::time_t updated;
+};
+
+// streamed data of an instance, kept column-wise until it is flushed into the
+// session as a batch
+struct Ingest {
+  std::string topic;  // may contain wildcards
+  std::string name;   // of the data frame growing in the session
+  std::string session_dir;
+  std::map<std::string, vrpc::json> columns;
+  std::size_t rows;
+};
+
+// C++ function called without R evaluation (see vrpc.h)
+struct NativeFunction {
+  vrpc::native_function function;
+  bool pooled;
 };
 
-std::function<void()> shutdown_handler;
+// draining: finishing accepted calls, read on both threads
+enum class AgentStatus { online, draining, offline };
+std::atomic<AgentStatus> agent_status{AgentStatus::online};
+
+const char* status_name(AgentStatus status) {
+  switch (status) {
+    case AgentStatus::online:
+      return "online";
+    case AgentStatus::draining:
+      return "draining";
+    default:
+      return "offline";
+  }
+}
 
 // availabe VRPC instances
 std::vector<std::string> instances;
 
 // mqtt client
-std::shared_ptr<mqtt::callable_overlay<mqtt::sync_client<
+std::shared_ptr<mqtt::callable_overlay<mqtt::async_client<
     mqtt::tcp_endpoint<as::ip::tcp::socket, as::io_context::strand>>>>
     client;
 
@@ -41,6 +148,213 @@ std::shared_ptr<mqtt::callable_overlay<mqtt::sync_client<
 int call_id = 0;
 std::unordered_map<int, vrpc::json> awaited_callbacks;
 
+// local socket on which results of detached forks are received
+std::string result_socket_path;
+
+// within a detached fork: connection to the agent and output forwarding
+int agent_connection = -1;
+std::thread output_thread;
+int saved_stdout = -1;
+int saved_stderr = -1;
+
+// handlers taking over results of specific calls (instead of replying them)
+std::unordered_map<int, std::function<void(vrpc::json&)>> continuations;
+
+// known jobs
+std::map<std::string, Job> jobs;
+
+// uploads in progress
+std::map<std::string, Upload> uploads;
+
+// data ingested into instances, buffered on the thread of the event loop and
+// managed from R's thread
+std::map<std::string, Ingest> ingests;
+std::mutex ingests_mutex;
+
+// registered native functions and the threads running them, registered from
+// R's thread and served on the thread of the event loop
+std::map<std::string, NativeFunction> native_functions;
+std::mutex native_functions_mutex;
+std::unique_ptr<boost::asio::thread_pool> native_pool;
+
+// not part of R's headers included here (see R_ext/GraphicsDevice.h)
+extern "C" Rboolean R_interrupts_suspended;
+
+// -- threading --
+// The event loop (network I/O, parsing) runs on its own thread, everything
+// touching R runs on R's main thread. Tasks for R are handed over through a
+// lock-free queue and a pipe waking up R's thread, which either waits for them
+// or, in background mode, gets them from R's event loop (input handler).
+// Tasks for the event loop are posted to it.
+
+// multi-producer single-consumer queue of tasks, intrusive and lock-free
+// (Vyukov), producers never block nor wait for each other
+class TaskQueue {
+ public:
+  TaskQueue() : _head(new Node), _tail(_head.load()) {}
+
+  ~TaskQueue() {
+    std::function<void()> task;
+    while (pop(task)) {
+    }
+    delete _tail;
+  }
+
+  void push(std::function<void()> task) {
+    Node* node = new Node;
+    node->task = std::move(task);
+    Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // consumer side only
+  bool pop(std::function<void()>& task) {
+    Node* next = _tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) return false;
+    task = std::move(next->task);
+    delete _tail;
+    _tail = next;
+    return true;
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    std::function<void()> task;
+  };
+  std::atomic<Node*> _head;
+  Node* _tail;
+};
+
+boost::asio::io_context* event_loop = nullptr;
+pid_t agent_pid = 0;
+std::thread io_thread;
+std::atomic<bool> agent_running{false};
+std::exception_ptr agent_error;
+TaskQueue r_tasks;
+// set while R's thread has (or will be) woken up
+std::atomic<bool> r_tasks_signaled{false};
+int r_tasks_pipe[2] = {-1, -1};
+InputHandler* r_tasks_handler = nullptr;
+
+// drains the agent (see `stop_vrpc_agent`)
+std::function<void()> drain_handler;
+// announces a native function registered while the agent runs
+std::function<void(const std::string&)> native_registered_handler;
+
+// dispositions of the signals the agent handles, as they were before it
+// started; restored on shutdown and within forks of R, whose signals must not
+// reach the agent's handlers
+struct sigaction previous_sigterm;
+struct sigaction previous_sigint;
+std::atomic<bool> sigterm_saved{false};
+std::atomic<bool> sigint_saved{false};
+
+void restore_signals() {
+  if (sigterm_saved) ::sigaction(SIGTERM, &previous_sigterm, nullptr);
+  if (sigint_saved) ::sigaction(SIGINT, &previous_sigint, nullptr);
+}
+
+// runs a task on the thread of the event loop
+void run_on_io(std::function<void()> task) {
+  boost::asio::post(*event_loop, std::move(task));
+}
+
+// runs a task on R's main thread
+void run_on_r(std::function<void()> task) {
+  r_tasks.push(std::move(task));
+  // a single wake-up per batch of tasks
+  if (r_tasks_signaled.exchange(true, std::memory_order_acq_rel)) return;
+  const char wakeup = 0;
+  if (::write(r_tasks_pipe[1], &wakeup, 1) < 0 && errno != EAGAIN) {
+    std::cout << "Could not wake up R: " << std::strerror(errno) << std::endl;
+  }
+}
+
+// runs a task on R's main thread and waits for it
+void run_on_r_sync(std::function<void()> task) {
+  std::promise<void> done;
+  run_on_r([&]() {
+    try {
+      task();
+      done.set_value();
+    } catch (...) {
+      done.set_exception(std::current_exception());
+    }
+  });
+  done.get_future().get();
+}
+
+// runs the pending tasks on R's thread, also called by R's event loop
+void run_r_tasks(void*) {
+  if (::getpid() != agent_pid) {
+    // within a fork of R the agent's tasks must not be touched
+    if (r_tasks_handler) removeInputHandler(&R_InputHandlers, r_tasks_handler);
+    r_tasks_handler = nullptr;
+    return;
+  }
+  char buffer[256];
+  while (::read(r_tasks_pipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+  // tasks pushed from now on wake up R's thread again
+  r_tasks_signaled.store(false, std::memory_order_release);
+  // an interrupt (Ctrl-C at the console in background mode) is kept pending
+  // until R checks for it again, it must not unwind through the tasks and
+  // R's event loop
+  const Rboolean interrupts_suspended = R_interrupts_suspended;
+  R_interrupts_suspended = TRUE;
+  std::function<void()> task;
+  while (r_tasks.pop(task)) {
+    try {
+      task();
+    } catch (const std::exception& e) {
+      std::cout << "Error while processing: " << e.what() << std::endl;
+    } catch (...) {
+      // e.g. an interrupt while R code was evaluated
+      std::cout << "Error while processing" << std::endl;
+    }
+  }
+  R_interrupts_suspended = interrupts_suspended;
+}
+
+// -- MQTT --
+// The client is used on the thread of the event loop only. Its operations are
+// asynchronous, packets queued while a write is in flight are concatenated
+// into a single write of up to these limits.
+constexpr std::size_t max_coalesced_packets = 256;
+constexpr std::size_t max_coalesced_bytes = 256 * 1024;
+
+void log_mqtt_error(const char* operation, mqtt::error_code ec) {
+  if (ec) std::cout << operation << " failed: " << ec.message() << std::endl;
+}
+
+void mqtt_publish(std::string topic,
+                  std::string payload,
+                  mqtt::publish_options options) {
+  run_on_io([topic = std::move(topic), payload = std::move(payload),
+             options]() mutable {
+    client->async_publish(
+        std::move(topic), std::move(payload), options,
+        [](mqtt::error_code ec) { log_mqtt_error("Publish", ec); });
+  });
+}
+
+void mqtt_subscribe(std::string topic) {
+  run_on_io([topic = std::move(topic)]() mutable {
+    client->async_subscribe(
+        std::move(topic), mqtt::qos::at_least_once,
+        [](mqtt::error_code ec) { log_mqtt_error("Subscribe", ec); });
+  });
+}
+
+void mqtt_unsubscribe(std::string topic) {
+  run_on_io([topic = std::move(topic)]() mutable {
+    client->async_unsubscribe(std::move(topic), [](mqtt::error_code ec) {
+      log_mqtt_error("Unsubscribe", ec);
+    });
+  });
+}
+
 // -- utility functions --
 std::vector<std::string> tokenize(const std::string& input,
                                   char const* delimiters) {
@@ -119,29 +433,370 @@ std::string get_platform() {
 #endif
 }
 
-template <class T>
-void publish_agent_info(const T& client, const Options& options) {
+std::int64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void make_directories(const std::string& path) {
+  std::string current(!path.empty() && path[0] == '/' ? "" : ".");
+  for (const auto& x : tokenize(path, "/")) {
+    current += "/" + x;
+    if (mkdir(current.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::runtime_error("Could not create directory: " + current);
+    }
+  }
+}
+
+std::vector<std::string> list_directory(const std::string& path) {
+  std::vector<std::string> entries;
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) return entries;
+  while (const dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') entries.push_back(entry->d_name);
+  }
+  closedir(dir);
+  return entries;
+}
+
+std::string read_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw std::runtime_error("Could not read file: " + path);
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+// writes to a temporary file first, so readers never see partial content
+void write_file(const std::string& path, const std::string& content) {
+  const std::string tmp(path + ".tmp");
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out << content;
+    if (!out) throw std::runtime_error("Could not write file: " + tmp);
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Could not write file: " + path);
+  }
+}
+
+std::string hex_digest(boost::uuids::detail::sha1& sha1) {
+  boost::uuids::detail::sha1::digest_type digest;
+  sha1.get_digest(digest);
+  std::ostringstream ss;
+  ss << std::hex << std::setfill('0');
+  // the digest is made of words or bytes depending on the boost version
+  for (const auto x : digest) {
+    ss << std::setw(2 * sizeof(x)) << static_cast<std::uint32_t>(x);
+  }
+  return ss.str();
+}
+
+std::string sha1_hex(const std::string& data) {
+  boost::uuids::detail::sha1 sha1;
+  sha1.process_bytes(data.data(), data.size());
+  return hex_digest(sha1);
+}
+
+std::string decode_base64(std::string data) {
+  using namespace boost::archive::iterators;
+  using iterator =
+      transform_width<binary_from_base64<std::string::const_iterator>, 8, 6>;
+  const auto padding = std::count(
+      data.end() - std::min<std::size_t>(2, data.size()), data.end(), '=');
+  std::replace(data.end() - padding, data.end(), '=', 'A');
+  std::string decoded(iterator(data.cbegin()), iterator(data.cend()));
+  decoded.resize(decoded.size() - padding);
+  return decoded;
+}
+
+void write_all(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw std::runtime_error("Could not write to agent socket");
+    data += n;
+    size -= n;
+  }
+}
+
+int connect_to_agent() {
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) throw std::runtime_error("Could not create agent socket");
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, result_socket_path.c_str(),
+               sizeof(addr.sun_path) - 1);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Could not connect to agent socket");
+  }
+  return fd;
+}
+
+void send_to_agent(int fd,
+                   int id,
+                   MessageType type,
+                   const std::string& payload) {
+  const ResultHeader header{id, type, payload.size()};
+  write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header));
+  write_all(fd, payload.data(), payload.size());
+}
+
+// forwards everything written to `fd` line by line to the agent, sending at
+// most ten messages (of at most 64 KiB) per second and dropping the excess
+void forward_output(int fd, int id) {
+  constexpr std::size_t max_size = 65536;
+  constexpr auto interval = 100ms;
+  std::string pending;
+  std::size_t dropped = 0;
+  auto last_sent = std::chrono::steady_clock::now() - interval;
+  bool open = true;
+  while (open || !pending.empty()) {
+    if (open) {
+      pollfd p{fd, POLLIN, 0};
+      if (::poll(&p, 1, 50) > 0) {
+        char buffer[4096];
+        const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+          pending.append(buffer, n);
+        } else if (n == 0 || errno != EINTR) {
+          open = false;
+        }
+      }
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (open && now - last_sent < interval) continue;
+    // only complete lines are sent, unless the stream was closed
+    const std::size_t end =
+        open ? pending.rfind('\n') + 1 : pending.size();
+    if (end == 0) continue;
+    std::string lines = pending.substr(0, end);
+    pending.erase(0, end);
+    if (lines.size() > max_size) {
+      dropped += std::count(lines.begin() + max_size, lines.end(), '\n');
+      lines.resize(max_size);
+    }
+    if (dropped > 0) {
+      lines += "[" + std::to_string(dropped) + " lines dropped]\n";
+      dropped = 0;
+    }
+    try {
+      send_to_agent(agent_connection, id, MessageType::output, lines);
+    } catch (...) {
+      break;
+    }
+    last_sent = now;
+  }
+  ::close(fd);
+}
+
+// [[Rcpp::export]]
+void start_output_stream(int id) {
+  int fds[2];
+  if (::pipe(fds) != 0) throw std::runtime_error("Could not create pipe");
+  agent_connection = connect_to_agent();
+  std::fflush(stdout);
+  std::fflush(stderr);
+  saved_stdout = ::dup(STDOUT_FILENO);
+  saved_stderr = ::dup(STDERR_FILENO);
+  ::dup2(fds[1], STDOUT_FILENO);
+  ::dup2(fds[1], STDERR_FILENO);
+  ::close(fds[1]);
+  std::setvbuf(stdout, nullptr, _IOLBF, 0);
+  output_thread = std::thread(forward_output, fds[0], id);
+}
+
+// [[Rcpp::export]]
+void stop_output_stream() {
+  if (!output_thread.joinable()) return;
+  std::fflush(stdout);
+  std::fflush(stderr);
+  // restoring the original descriptors closes the pipe's write end
+  ::dup2(saved_stdout, STDOUT_FILENO);
+  ::dup2(saved_stderr, STDERR_FILENO);
+  ::close(saved_stdout);
+  ::close(saved_stderr);
+  output_thread.join();
+}
+
+// receives the results of detached forks on a local socket
+class ResultServer {
+  using protocol = boost::asio::local::stream_protocol;
+
+ public:
+  using Handler = std::function<void(const ResultHeader&, std::string)>;
+
+  ResultServer(boost::asio::io_context& ioc,
+               const std::string& path,
+               Handler handler)
+      : path_(path), acceptor_(ioc), handler_(std::move(handler)) {
+    ::unlink(path_.c_str());
+    acceptor_.open();
+    acceptor_.bind(protocol::endpoint(path_));
+    acceptor_.listen();
+    accept();
+  }
+
+  ~ResultServer() { ::unlink(path_.c_str()); }
+
+ private:
+  struct Connection {
+    explicit Connection(protocol::socket s) : socket(std::move(s)) {}
+    protocol::socket socket;
+    ResultHeader header;
+    std::string payload;
+  };
+
+  void accept() {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, protocol::socket socket) {
+          if (ec) return;
+          read(std::make_shared<Connection>(std::move(socket)));
+          accept();
+        });
+  }
+
+  void read(std::shared_ptr<Connection> c) {
+    boost::asio::async_read(
+        c->socket, boost::asio::buffer(&c->header, sizeof(c->header)),
+        [this, c](boost::system::error_code ec, std::size_t) {
+          if (ec) return;
+          c->payload.resize(c->header.size);
+          boost::asio::async_read(
+              c->socket, boost::asio::buffer(&c->payload[0], c->payload.size()),
+              [this, c](boost::system::error_code ec, std::size_t) {
+                if (ec) return;
+                handler_(c->header, std::move(c->payload));
+                // a connection may carry output messages before the result
+                read(c);
+              });
+        });
+  }
+
+  std::string path_;
+  protocol::acceptor acceptor_;
+  Handler handler_;
+};
+
+// adapts the number of concurrently evaluated calls at runtime (AIMD): grows
+// slowly while calls have to wait and shrinks quickly when the execution
+// latency degrades against its long-term baseline or the host is overloaded
+class ConcurrencyLimit {
+ public:
+  ConcurrencyLimit(int initial, int max)
+      : min_(std::min(2, std::max(1, max))),
+        max_(std::max(1, max)),
+        cores_(std::max(1u, std::thread::hardware_concurrency())),
+        limit_(std::max(min_, std::min(initial, max_))) {}
+
+  int value() const { return static_cast<int>(limit_); }
+
+  // feeds the queue wait and execution time of a finished call together with
+  // the usual execution time of its function (negative if unknown yet), as
+  // functions differ in their latencies by orders of magnitude
+  void update(double wait_ms, double exec_ms, double baseline_ms) {
+    if (baseline_ms >= 0) {
+      // above 1 if calls take more than twice as long as usual
+      const double slowdown = exec_ms / (2 * baseline_ms + 10);
+      slowdown_ = 0.8 * slowdown_ + 0.2 * slowdown;
+    }
+    const std::int64_t now = now_ms();
+    if (load_ > cores_ || slowdown_ > 1) {
+      // decreasing at most once per second, as many calls finish at once
+      if (now - last_decrease_ > 1000) {
+        limit_ = std::max<double>(min_, limit_ * 0.75);
+        last_decrease_ = now;
+      }
+    } else if (wait_ms > 0) {
+      limit_ = std::min<double>(max_, limit_ + 1 / limit_);
+    }
+  }
+
+  // samples the load average of the host
+  void refresh() {
+    double load[1];
+    if (getloadavg(load, 1) == 1) load_ = load[0];
+  }
+
+ private:
+  const int min_;
+  const int max_;
+  const unsigned cores_;
+  double limit_;
+  double slowdown_ = 0;  // recent execution latency relative to the usual
+  double load_ = 0;
+  std::int64_t last_decrease_ = 0;
+};
+
+// an R call waiting for (or in) evaluation
+struct PendingCall {
+  int id;
+  std::string function;
+  std::string args;
+  std::string instance;
+  std::string args_file;
+  std::int64_t queued;
+  std::int64_t deadline;  // in ms since epoch, 0 if there is none
+  std::int64_t started;
+  int pid;
+  int dead_checks;
+};
+
+std::unique_ptr<ConcurrencyLimit> concurrency_limit;
+std::deque<PendingCall> call_queue;
+std::unordered_map<int, PendingCall> running_calls;
+
+// recent execution time of each function, used to judge deadlines and as
+// latency baseline of the concurrency limit
+std::unordered_map<std::string, double> execution_estimates;
+
+// counters reported by `__metrics__`, counted on both threads (native
+// functions are served by the event loop)
+struct Metrics {
+  std::atomic<std::uint64_t> requests{0};
+  std::atomic<std::uint64_t> completed{0};
+  // as their deadline passed or could not be met
+  std::atomic<std::uint64_t> dropped{0};
+} metrics;
+
+void publish_agent_info(const Options& options) {
   vrpc::json j;
-  j["status"] = "online";
+  j["status"] = status_name(agent_status);
   j["hostname"] = get_hostname();
   j["version"] = options.version;
+  j["sharedContextSize"] = options.shared_size;
+  j["concurrencyLimit"] = concurrency_limit->value();
   j["v"] = VRPC_PROTOCOL_VERSION;
   const std::string topic(options.domain + "/" + options.agent +
                           "/__agentInfo__");
-  client->publish(topic, j.dump(),
-                  mqtt::qos::at_least_once | mqtt::retain::yes);
+  mqtt_publish(topic, j.dump(), mqtt::qos::at_least_once | mqtt::retain::yes);
 }
 
-template <class T>
-void publish_class_info(const T& client, const Options& options) {
+void publish_class_info(const Options& options) {
   vrpc::json j;
   j["className"] = "Session";
   j["instances"] = instances;
-  std::vector<std::string> s{"__createShared__", "call"};
+  std::vector<std::string> s{"__createShared__", "__createTemplate__",
+                             "__clone__",        "__exportSession__",
+                             "__exportChunk__",  "__importSession__",
+                             "__importChunk__",  "__reload__",
+                             "call",             "__upload__",
+                             "__callChunk__",    "__map__",
+                             "__pipeline__",     "__submitJob__",
+                             "__jobStatus__",    "__jobResult__",
+                             "__metrics__"};
   s.insert(std::end(s), std::begin(options.functions),
            std::end(options.functions));
+  {
+    std::lock_guard<std::mutex> lock(native_functions_mutex);
+    for (const auto& x : native_functions) s.push_back(x.first);
+  }
   j["staticFunctions"] = s;
-  std::vector<std::string> m{"call"};
+  std::vector<std::string> m{"call",          "__pipeline__",
+                             "__submitJob__", "__callChunk__",
+                             "__ingest__",    "__flush__"};
   m.insert(std::end(m), std::begin(options.functions),
            std::end(options.functions));
   j["memberFunctions"] = m;
@@ -149,14 +804,13 @@ void publish_class_info(const T& client, const Options& options) {
   j["v"] = VRPC_PROTOCOL_VERSION;
   const std::string topic(options.domain + "/" + options.agent +
                           "/Session/__classInfo__");
-  client->publish(topic, j.dump(),
-                  mqtt::qos::at_least_once | mqtt::retain::yes);
+  mqtt_publish(topic, j.dump(), mqtt::qos::at_least_once | mqtt::retain::yes);
 }
 
+// stable across restarts (and builds), the broker keeps the session of the
+// agent under this id
 std::string generate_client_id(const Options& options) {
-  const std::string tmp = options.domain + options.agent;
-  std::to_string(std::hash<std::string>{}(tmp)).substr(0, 20);
-  return "va3" + std::to_string(std::hash<std::string>{}(tmp)).substr(0, 20);
+  return "va3" + sha1_hex(options.domain + "/" + options.agent).substr(0, 20);
 }
 
 std::string generate_agent_name() {
@@ -194,6 +848,22 @@ Options parse_arguments(const Rcpp::List& args) {
                       ? generate_agent_name()
                       : Rcpp::as<std::string>(args["agent"]);
   options.functions = Rcpp::as<std::vector<std::string>>(args["functions"]);
+  options.state_dir = Rcpp::as<std::string>(args["state_dir"]);
+  options.socket = Rcpp::as<std::string>(args["socket"]);
+  options.job_ttl = Rcpp::as<int>(args["job_ttl"]);
+  options.init = args["init"] == R_NilValue
+                     ? std::string()
+                     : Rcpp::as<std::string>(args["init"]);
+  options.shared_size = Rcpp::as<double>(args["shared_size"]);
+  options.source = Rcpp::as<std::string>(args["source"]);
+  options.watch = Rcpp::as<int>(args["watch"]);
+  options.blob_ttl = Rcpp::as<int>(args["blob_ttl"]);
+  options.blob_budget = Rcpp::as<double>(args["blob_budget"]);
+  options.spool_size = Rcpp::as<double>(args["spool_size"]);
+  options.native_threads = Rcpp::as<int>(args["native_threads"]);
+  options.max_concurrency = Rcpp::as<int>(args["max_concurrency"]);
+  options.drain_timeout = Rcpp::as<int>(args["drain_timeout"]);
+  options.background = Rcpp::as<bool>(args["background"]);
   return options;
 }
 
@@ -208,11 +878,861 @@ mqtt::will create_will_message(const Options& options) {
           mqtt::qos::at_least_once | mqtt::retain::yes};
 }
 
-// [[Rcpp::export]]
-void on_execution_done(int id, const Rcpp::CharacterVector& cv) {
-  vrpc::json j = awaited_callbacks[id];
-  awaited_callbacks.erase(id);
-  const std::string ret = Rcpp::as<std::string>(cv);
+// calls an R function of this package, R errors are caught in R (see
+// `call_internal` in Adapter.R) and thrown as C++ exceptions here, as an R
+// error must not unwind through the agent
+template <class... Args>
+SEXP call_r_internal(const std::string& name, Args&&... args) {
+  static Rcpp::Environment ns = Rcpp::Environment::namespace_env("vrpc");
+  static Rcpp::Function call_internal(ns.get("call_internal"));
+  Rcpp::RObject result = call_internal(name, std::forward<Args>(args)...);
+  if (Rf_inherits(result, "error")) {
+    const Rcpp::List error(result);
+    throw std::runtime_error(Rcpp::as<std::string>(error["message"]));
+  }
+  return result;
+}
+
+// -- outbound spool --
+// Replies that cannot be sent (no connection, failed write) are appended to a
+// log file in the state directory, one JSON line each, and published in order
+// once connected again. The log is bounded by `spool_size` bytes. Replies
+// carry the request id, hence receivers can detect duplicates (e.g. a reply
+// that was also resent from the session).
+struct SpooledReply {
+  std::string topic;
+  std::string payload;
+  std::string id;
+};
+
+std::string spool_path;
+double spool_limit = 0;
+std::size_t spool_bytes = 0;
+// topic and request id of the spooled replies (replies without id are never
+// considered duplicates)
+std::unordered_set<std::string> spooled;
+
+void publish_reply(std::shared_ptr<const SpooledReply> reply);
+
+// appends a reply to the spool (thread of the event loop)
+void spool_reply(const SpooledReply& reply) {
+  const std::string key = reply.topic + "\n" + reply.id;
+  if (!reply.id.empty() && spooled.count(key)) return;
+  const std::string line =
+      vrpc::json{{"s", reply.topic}, {"i", reply.id}, {"p", reply.payload}}
+          .dump() +
+      "\n";
+  if (spool_bytes + line.size() > spool_limit) {
+    std::cout << "Spool full, dropping reply to " << reply.topic << std::endl;
+    return;
+  }
+  std::ofstream out(spool_path, std::ios::app | std::ios::binary);
+  out << line << std::flush;
+  if (!out) {
+    std::cout << "Could not spool reply to " << reply.topic << std::endl;
+    return;
+  }
+  spool_bytes += line.size();
+  if (!reply.id.empty()) spooled.insert(key);
+}
+
+// replies of a previous run are published after connecting
+void restore_spool(const Options& options) {
+  spool_path = options.state_dir + "/spool.log";
+  spool_limit = options.spool_size;
+  std::ifstream in(spool_path, std::ios::binary);
+  std::string line;
+  while (std::getline(in, line)) {
+    const auto j = vrpc::json::parse(line, nullptr, false);
+    if (j.is_discarded()) continue;
+    spool_bytes += line.size() + 1;
+    const std::string id = j["i"];
+    if (!id.empty()) spooled.insert(j["s"].get<std::string>() + "\n" + id);
+  }
+}
+
+// publishes the spooled replies in order (thread of the event loop)
+void drain_spool() {
+  if (spool_bytes == 0) return;
+  std::vector<std::shared_ptr<const SpooledReply>> replies;
+  {
+    std::ifstream in(spool_path, std::ios::binary);
+    std::string line;
+    while (std::getline(in, line)) {
+      // a partially written last line is skipped
+      const auto j = vrpc::json::parse(line, nullptr, false);
+      if (j.is_discarded()) continue;
+      replies.push_back(std::make_shared<SpooledReply>(
+          SpooledReply{j["s"], j["p"], j["i"]}));
+    }
+  }
+  std::remove(spool_path.c_str());
+  spool_bytes = 0;
+  spooled.clear();
+  std::cout << "Sending " << replies.size() << " spooled replies" << std::endl;
+  // replies not getting out are spooled again
+  for (auto& reply : replies) publish_reply(std::move(reply));
+}
+
+void publish_reply(std::shared_ptr<const SpooledReply> reply) {
+  if (!client->connected()) {
+    spool_reply(*reply);
+    return;
+  }
+  client->async_publish(as::buffer(reply->topic), as::buffer(reply->payload),
+                        mqtt::qos::at_least_once, mqtt::v5::properties{},
+                        reply, [reply](mqtt::error_code ec) {
+                          if (!ec) return;
+                          log_mqtt_error("Publish", ec);
+                          spool_reply(*reply);
+                        });
+}
+
+void reply(const vrpc::json& j) {
+  auto reply = std::make_shared<const SpooledReply>(
+      SpooledReply{j["s"].get<std::string>(), j.dump(),
+                   j.contains("i") ? j["i"].dump() : ""});
+  run_on_io([reply = std::move(reply)]() { publish_reply(reply); });
+}
+
+void handle_execution_result(int id, const std::string& ret);
+void complete_call(int id, const std::string& ret);
+
+void start_call(PendingCall call) {
+  const SEXP instance =
+      call.instance.empty() ? R_NilValue : Rcpp::wrap(call.instance);
+  const SEXP args =
+      call.args_file.empty() ? Rcpp::wrap(call.args) : R_NilValue;
+  const SEXP args_file =
+      call.args_file.empty() ? R_NilValue : Rcpp::wrap(call.args_file);
+  call.started = now_ms();
+  call.dead_checks = 0;
+  if (call.function == "map_parallel") {
+    // the workers of a map share the calls' concurrency limit
+    const int free_slots =
+        concurrency_limit->value() - static_cast<int>(running_calls.size());
+    call_r_internal("set_map_cores", std::max(1, free_slots));
+  }
+  // this function is implemented in R (Adapter.R) and we will call it from C++
+  call.pid = Rcpp::as<int>(call_r_internal("vrpc_call", call.function, args,
+                                           call.id, instance, args_file));
+  running_calls[call.id] = std::move(call);
+}
+
+bool below_concurrency_limit() {
+  return static_cast<int>(running_calls.size()) < concurrency_limit->value();
+}
+
+// absolute deadline of a request in ms since epoch (a relative one, `t`, is
+// converted on receipt)
+std::int64_t request_deadline(const vrpc::json& j) {
+  if (j.contains("d")) return j["d"].get<std::int64_t>();
+  return 0;
+}
+
+// converts a relative deadline based on the time of receipt, throws if the
+// deadline passed already
+void check_deadline(vrpc::json& j, std::int64_t received) {
+  if (j.contains("t") && !j.contains("d")) {
+    j["d"] = received + j["t"].get<std::int64_t>();
+  }
+  if (j.contains("d") && now_ms() > request_deadline(j)) {
+    ++metrics.dropped;
+    throw std::runtime_error("Deadline exceeded");
+  }
+}
+
+bool is_expired(const PendingCall& call) {
+  if (call.deadline == 0) return false;
+  auto it = execution_estimates.find(call.function);
+  const double estimate = it == execution_estimates.end() ? 0 : it->second;
+  return now_ms() + estimate > call.deadline;
+}
+
+// evaluates queued calls as long as the concurrency limit allows, calls that
+// can not meet their deadline any more are dropped
+void dispatch_calls() {
+  // failed calls are completed after the loop, as completing a call dispatches
+  // again (a long backlog of expired calls must not recurse)
+  std::vector<std::pair<int, std::string>> failed;
+  while (!call_queue.empty() && below_concurrency_limit()) {
+    PendingCall call = std::move(call_queue.front());
+    call_queue.pop_front();
+    const int id = call.id;
+    if (is_expired(call)) {
+      ++metrics.dropped;
+      failed.emplace_back(id, "__err__Deadline exceeded");
+      continue;
+    }
+    try {
+      start_call(std::move(call));
+    } catch (const std::exception& e) {
+      failed.emplace_back(id, "__err__" + std::string(e.what()));
+    }
+  }
+  for (const auto& x : failed) complete_call(x.first, x.second);
+}
+
+// the result of a call arrived, its latency adapts the concurrency limit
+void finish_call(int id) {
+  auto it = running_calls.find(id);
+  if (it == running_calls.end()) return;
+  const std::int64_t now = now_ms();
+  const double duration = now - it->second.started;
+  auto estimate = execution_estimates.find(it->second.function);
+  const double baseline =
+      estimate == execution_estimates.end() ? -1 : estimate->second;
+  concurrency_limit->update(it->second.started - it->second.queued, duration,
+                            baseline);
+  if (estimate == execution_estimates.end()) {
+    execution_estimates[it->second.function] = duration;
+  } else {
+    estimate->second = 0.8 * estimate->second + 0.2 * duration;
+  }
+  ++metrics.completed;
+  running_calls.erase(it);
+}
+
+// fails calls whose evaluating process vanished without sending a result
+void reap_lost_calls() {
+  std::vector<int> lost;
+  for (auto& x : running_calls) {
+    if (::kill(x.second.pid, 0) == 0 || errno != ESRCH) continue;
+    // results sent right before exiting are given time to be received
+    if (++x.second.dead_checks > 1) lost.push_back(x.first);
+  }
+  for (const auto id : lost) {
+    handle_execution_result(id,
+                            "__err__Evaluation terminated unexpectedly");
+  }
+}
+
+// starts the call right away if the limit allows, otherwise queues it
+int enqueue_call(const vrpc::json& j, PendingCall call) {
+  // register next asynchronous R call
+  const int id = call.id = ++call_id;
+  call.queued = now_ms();
+  call.deadline = request_deadline(j);
+  if (is_expired(call)) {
+    ++metrics.dropped;
+    throw std::runtime_error("Deadline exceeded");
+  }
+  awaited_callbacks[id] = j;
+  if (!call_queue.empty() || !below_concurrency_limit()) {
+    call_queue.push_back(std::move(call));
+    return id;
+  }
+  try {
+    start_call(std::move(call));
+  } catch (...) {
+    awaited_callbacks.erase(id);
+    throw;
+  }
+  return id;
+}
+
+// starts the detached evaluation of an R function, its result will arrive at
+// `handle_execution_result` under the returned call id
+int call_r_function(const vrpc::json& j,
+                    const std::string& function,
+                    const vrpc::json& args,
+                    const std::string& instance = "") {
+  std::string r_function = function;
+  vrpc::json r_args = args;
+  if (function == "call") {
+    // generic call, first argument encodes R function name
+    r_function = args[0];
+    r_args = vrpc::json::array();
+    for (size_t i = 1; i < args.size(); ++i) {
+      r_args.push_back(args[i]);
+    }
+  }
+  PendingCall call{};
+  call.function = r_function;
+  call.args = r_args.dump();
+  call.instance = instance;
+  return enqueue_call(j, std::move(call));
+}
+
+// like `call_r_function`, but the fork reads the JSON encoded arguments from a
+// file (and removes it)
+int call_r_function_file(const vrpc::json& j,
+                         const std::string& function,
+                         const std::string& args_file,
+                         const std::string& instance = "") {
+  PendingCall call{};
+  call.function = function;
+  call.instance = instance;
+  call.args_file = args_file;
+  return enqueue_call(j, std::move(call));
+}
+
+// subscribes many topics using few SUBSCRIBE packets
+void subscribe_batched(const std::vector<std::string>& topics) {
+  constexpr size_t batch_size = 256;
+  for (size_t i = 0; i < topics.size(); i += batch_size) {
+    std::vector<std::tuple<std::string, mqtt::subscribe_options>> batch;
+    for (size_t k = i; k < std::min(i + batch_size, topics.size()); ++k) {
+      batch.emplace_back(topics[k], mqtt::qos::at_least_once);
+    }
+    run_on_io([batch = std::move(batch)]() mutable {
+      client->async_subscribe(std::move(batch), [](mqtt::error_code ec) {
+        log_mqtt_error("Subscribe", ec);
+      });
+    });
+  }
+}
+
+std::string instance_topic(const std::string& instance,
+                           const Options& options) {
+  return options.domain + "/" + options.agent + "/Session/" + instance + "/+";
+}
+
+// -- streaming ingest --
+constexpr std::size_t max_ingest_rows = 10000;
+
+bool topic_matches(const std::string& filter, const std::string& topic) {
+  const auto f = tokenize(filter, "/");
+  const auto t = tokenize(topic, "/");
+  for (size_t i = 0; i < f.size(); ++i) {
+    if (f[i] == "#") return true;
+    if (i >= t.size() || (f[i] != "+" && f[i] != t[i])) return false;
+  }
+  return f.size() == t.size();
+}
+
+// requires `ingests_mutex`
+void persist_ingests(const Options& options) {
+  vrpc::json j = vrpc::json::object();
+  for (const auto& x : ingests) {
+    j[x.first] = {{"topic", x.second.topic}, {"name", x.second.name}};
+  }
+  write_file(options.state_dir + "/ingests.json", j.dump());
+}
+
+void restore_ingests(const Options& options) {
+  const std::string file(options.state_dir + "/ingests.json");
+  if (access(file.c_str(), F_OK) != 0) return;
+  std::lock_guard<std::mutex> lock(ingests_mutex);
+  try {
+    for (const auto& x : vrpc::json::parse(read_file(file)).items()) {
+      if (std::find(std::begin(instances), std::end(instances), x.key()) ==
+          std::end(instances)) {
+        continue;
+      }
+      Ingest& ingest = ingests[x.key()];
+      ingest.topic = x.value()["topic"];
+      ingest.name = x.value()["name"];
+      ingest.session_dir = Rcpp::as<std::string>(
+          call_r_internal("create_session_dir", x.key()));
+      ingest.rows = 0;
+    }
+  } catch (const std::exception& e) {
+    std::cout << "Could not restore ingests: " << e.what() << std::endl;
+  }
+}
+
+// writes the buffered rows as batch into the session directory, the next call
+// on the session appends them to the data frame, returns the number of rows
+// (requires `ingests_mutex`)
+std::size_t write_batch(Ingest& ingest) {
+  if (ingest.rows == 0) return 0;
+  static int batch = 0;
+  batch = (batch + 1) % 1000000;
+  std::ostringstream file;
+  file << ingest.session_dir << "/.ingest/" << now_ms() << "-"
+       << std::setw(6) << std::setfill('0') << batch << ".json";
+  make_directories(ingest.session_dir + "/.ingest");
+  write_file(file.str(), vrpc::json{{"name", ingest.name},
+                                    {"columns", ingest.columns}}.dump());
+  const std::size_t rows = ingest.rows;
+  ingest.columns.clear();
+  ingest.rows = 0;
+  return rows;
+}
+
+std::size_t flush_ingest(const std::string& instance) {
+  std::lock_guard<std::mutex> lock(ingests_mutex);
+  auto it = ingests.find(instance);
+  return it == ingests.end() ? 0 : write_batch(it->second);
+}
+
+void flush_ingests() {
+  std::lock_guard<std::mutex> lock(ingests_mutex);
+  for (auto& x : ingests) write_batch(x.second);
+}
+
+void append_row(Ingest& ingest, const vrpc::json& row) {
+  if (!row.is_object()) throw std::runtime_error("Rows must be JSON objects");
+  for (const auto& x : row.items()) {
+    auto& column = ingest.columns[x.key()];
+    if (column.is_null()) {
+      // new column, earlier rows are missing the value
+      column = vrpc::json::array();
+      for (size_t i = 0; i < ingest.rows; ++i) column.push_back(nullptr);
+    }
+  }
+  for (auto& x : ingest.columns) {
+    auto value = row.find(x.first);
+    x.second.push_back(value == row.end() ? vrpc::json() : *value);
+  }
+  ++ingest.rows;
+}
+
+// buffers a message (a row object or an array of rows) for all instances
+// ingesting the topic, returns whether the topic was an ingested one
+bool ingest_message(const std::string& topic,
+                    const vrpc::json& data,
+                    const Options& options) {
+  // the agent's own topics are never ingested
+  if (topic.compare(0, options.domain.size() + options.agent.size() + 2,
+                    options.domain + "/" + options.agent + "/") == 0) {
+    return false;
+  }
+  bool matched = false;
+  std::lock_guard<std::mutex> lock(ingests_mutex);
+  try {
+    for (auto& x : ingests) {
+      Ingest& ingest = x.second;
+      if (!topic_matches(ingest.topic, topic)) continue;
+      if (data.is_discarded()) throw std::runtime_error("Invalid JSON");
+      matched = true;
+      if (data.is_array()) {
+        for (const auto& row : data) append_row(ingest, row);
+      } else {
+        append_row(ingest, data);
+      }
+      if (ingest.rows >= max_ingest_rows) write_batch(ingest);
+    }
+  } catch (const std::exception& e) {
+    std::cout << "Could not ingest message on " << topic << ": " << e.what()
+              << std::endl;
+  }
+  return matched;
+}
+
+void unregister_ingest(const std::string& instance, const Options& options) {
+  std::string topic;
+  {
+    std::lock_guard<std::mutex> lock(ingests_mutex);
+    auto it = ingests.find(instance);
+    if (it == ingests.end()) return;
+    write_batch(it->second);
+    topic = it->second.topic;
+    ingests.erase(it);
+    persist_ingests(options);
+    // the topic may still be ingested by other instances
+    for (const auto& x : ingests) {
+      if (x.second.topic == topic) return;
+    }
+  }
+  mqtt_unsubscribe(topic);
+}
+
+void register_ingest(const std::string& instance,
+                     const std::string& topic,
+                     const std::string& name,
+                     const Options& options) {
+  unregister_ingest(instance, options);
+  const std::string session_dir =
+      Rcpp::as<std::string>(call_r_internal("create_session_dir", instance));
+  {
+    std::lock_guard<std::mutex> lock(ingests_mutex);
+    Ingest& ingest = ingests[instance];
+    ingest.topic = topic;
+    ingest.name = name;
+    ingest.session_dir = session_dir;
+    ingest.rows = 0;
+    persist_ingests(options);
+  }
+  mqtt_subscribe(topic);
+}
+
+// the registry survives restarts of the agent
+void persist_instances(const Options& options) {
+  write_file(options.state_dir + "/instances.json",
+             vrpc::json(instances).dump());
+}
+
+// restores all registered instances whose session is still in the store
+void restore_instances(const Options& options) {
+  const std::string file(options.state_dir + "/instances.json");
+  if (access(file.c_str(), F_OK) != 0) return;
+  try {
+    for (const auto& x : vrpc::json::parse(read_file(file))) {
+      const std::string instance = x.get<std::string>();
+      if (Rcpp::as<bool>(call_r_internal("session_dir_exists", instance))) {
+        instances.push_back(instance);
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cout << "Could not restore instances: " << e.what() << std::endl;
+  }
+  std::cout << "Restored " << instances.size() << " instance(s)" << std::endl;
+}
+
+void register_instance(const std::string& instance, const Options& options) {
+  mqtt_subscribe(instance_topic(instance, options));
+  if (std::find(std::begin(instances), std::end(instances), instance) ==
+      std::end(instances)) {
+    call_r_internal("create_session_dir", instance);
+    instances.push_back(instance);
+    persist_instances(options);
+  }
+  publish_class_info(options);
+}
+
+bool unregister_instance(const std::string& instance, const Options& options) {
+  mqtt_unsubscribe(instance_topic(instance, options));
+  auto it = std::find(std::begin(instances), std::end(instances), instance);
+  if (it == std::end(instances)) return false;
+  unregister_ingest(instance, options);
+  instances.erase(it);
+  persist_instances(options);
+  publish_class_info(options);
+  return true;
+}
+
+// re-sources the agent's functions and updates subscriptions accordingly
+vrpc::json reload_functions(Options& options) {
+  const auto functions = Rcpp::as<std::vector<std::string>>(
+      call_r_internal("reload_functions"));
+  const std::string base_topic(options.domain + "/" + options.agent +
+                               "/Session/__static__/");
+  vrpc::json added(vrpc::json::array());
+  vrpc::json removed(vrpc::json::array());
+  for (const auto& x : functions) {
+    if (std::find(std::begin(options.functions), std::end(options.functions),
+                  x) == std::end(options.functions)) {
+      mqtt_subscribe(base_topic + x);
+      added.push_back(x);
+    }
+  }
+  for (const auto& x : options.functions) {
+    if (std::find(std::begin(functions), std::end(functions), x) ==
+        std::end(functions)) {
+      mqtt_unsubscribe(base_topic + x);
+      removed.push_back(x);
+    }
+  }
+  options.functions = functions;
+  publish_class_info(options);
+  return {{"added", added}, {"removed", removed}};
+}
+
+std::time_t modification_time(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+// reloads the functions whenever the source file changed
+void schedule_source_watch(boost::asio::steady_timer& timer,
+                           Options& options,
+                           std::time_t mtime) {
+  timer.expires_after(std::chrono::seconds(options.watch));
+  timer.async_wait([&, mtime](const boost::system::error_code& ec) {
+    if (ec) return;
+    const std::time_t current = modification_time(options.source);
+    if (current != mtime) {
+      run_on_r([&]() {
+        try {
+          const auto changes = reload_functions(options);
+          std::cout << "Reloaded " << options.source << ": " << changes.dump()
+                    << std::endl;
+        } catch (const std::exception& e) {
+          std::cout << "Failed reloading " << options.source << ": "
+                    << e.what() << std::endl;
+        }
+      });
+    }
+    schedule_source_watch(timer, options, current);
+  });
+}
+
+// -- asynchronous jobs --
+std::string job_file(const std::string& job_id, const Options& options) {
+  return options.state_dir + "/jobs/" + job_id + ".json";
+}
+
+std::string generate_job_id() {
+  static std::mt19937_64 engine{std::random_device{}()};
+  std::ostringstream ss;
+  ss << std::hex << std::setfill('0') << std::setw(16) << engine();
+  return ss.str();
+}
+
+vrpc::json job_info(const std::string& job_id, const Job& job) {
+  vrpc::json j{{"id", job_id}, {"status", job.status}, {"created", job.created}};
+  if (job.finished) j["finished"] = job.finished;
+  return j;
+}
+
+void persist_job(const std::string& job_id,
+                 const Job& job,
+                 const Options& options,
+                 const vrpc::json& result = vrpc::json::object()) {
+  vrpc::json j = job_info(job_id, job);
+  // running jobs are persisted as queued, so a restart executes them again
+  if (job.status == "running") j["status"] = "queued";
+  j["request"] = job.request;
+  j.update(result);
+  write_file(job_file(job_id, options), j.dump());
+}
+
+void complete_job(const std::string& job_id,
+                  const vrpc::json& j,
+                  const Options& options);
+
+void run_job(const std::string& job_id, Job& job, const Options& options) {
+  const vrpc::json& request = job.request;
+  const int id = call_r_function(request, request["f"], request["a"],
+                                 request["instance"]);
+  continuations[id] = [job_id, &options](vrpc::json& j) {
+    complete_job(job_id, j, options);
+  };
+  job.status = "running";
+}
+
+std::string submit_job(const std::string& instance,
+                       const vrpc::json& args,
+                       const Options& options) {
+  if (args.empty() || !args[0].is_string()) {
+    throw std::runtime_error("First argument must be the function to run");
+  }
+  const std::string job_id = generate_job_id();
+  Job& job = jobs[job_id];
+  job.status = "queued";
+  job.created = now_ms();
+  job.finished = 0;
+  job.request = {{"f", args[0]},
+                 {"a", vrpc::json(args.begin() + 1, args.end())},
+                 {"instance", instance}};
+  try {
+    persist_job(job_id, job, options);
+    run_job(job_id, job, options);
+  } catch (...) {
+    ::unlink(job_file(job_id, options).c_str());
+    jobs.erase(job_id);
+    throw;
+  }
+  return job_id;
+}
+
+void complete_job(const std::string& job_id,
+                  const vrpc::json& j,
+                  const Options& options) {
+  auto it = jobs.find(job_id);
+  if (it == jobs.end()) return;
+  Job& job = it->second;
+  const bool failed = j.contains("e");
+  job.status = failed ? "failed" : "done";
+  job.finished = now_ms();
+  const vrpc::json result =
+      failed ? vrpc::json{{"e", j["e"]}} : vrpc::json{{"r", j["r"]}};
+  persist_job(job_id, job, options, result);
+  for (auto& waiter : job.waiters) {
+    waiter.update(result);
+    reply(waiter);
+  }
+  job.waiters.clear();
+}
+
+// answers immediately if the job is finished, otherwise once it finishes
+void request_job_result(vrpc::json& j,
+                        const std::string& job_id,
+                        const Options& options) {
+  auto it = jobs.find(job_id);
+  if (it == jobs.end()) {
+    throw std::runtime_error("Unknown job: " + job_id);
+  }
+  if (it->second.finished == 0) {
+    it->second.waiters.push_back(j);
+    return;
+  }
+  const auto stored = vrpc::json::parse(read_file(job_file(job_id, options)));
+  if (stored.contains("e")) {
+    j["e"] = stored["e"];
+  } else {
+    j["r"] = stored["r"];
+  }
+  reply(j);
+}
+
+// loads the job store, re-running jobs that did not finish before a restart
+void restore_jobs(const Options& options) {
+  const std::string dir(options.state_dir + "/jobs");
+  make_directories(dir);
+  for (const auto& file : list_directory(dir)) {
+    const size_t pos = file.rfind(".json");
+    if (pos == std::string::npos || pos + 5 != file.size()) continue;
+    const std::string job_id = file.substr(0, pos);
+    try {
+      const auto j = vrpc::json::parse(read_file(dir + "/" + file));
+      Job& job = jobs[job_id];
+      job.status = j["status"];
+      job.request = j["request"];
+      job.created = j["created"];
+      job.finished = j.value("finished", std::int64_t(0));
+      if (job.status == "queued") run_job(job_id, job, options);
+    } catch (const std::exception& e) {
+      std::cout << "Could not restore job " << job_id << ": " << e.what()
+                << std::endl;
+      jobs.erase(job_id);
+    }
+  }
+}
+
+void purge_jobs(const Options& options) {
+  const std::int64_t expired = now_ms() - options.job_ttl * 1000LL;
+  for (auto it = jobs.begin(); it != jobs.end();) {
+    if (it->second.finished != 0 && it->second.finished < expired) {
+      ::unlink(job_file(it->first, options).c_str());
+      it = jobs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// -- blob store --
+std::string blob_file(const std::string& hash, const Options& options) {
+  return options.state_dir + "/blobs/" + hash + ".rds";
+}
+
+// removes blobs unused for longer than their ttl and then the least recently
+// used ones until the store fits into its budget
+void purge_blobs(const Options& options) {
+  const std::string dir(options.state_dir + "/blobs");
+  const std::time_t expired = std::time(nullptr) - options.blob_ttl;
+  std::vector<std::pair<std::time_t, std::string>> blobs;
+  double total = 0;
+  for (const auto& file : list_directory(dir)) {
+    const std::string path(dir + "/" + file);
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) continue;
+    if (info.st_mtime < expired) {
+      ::unlink(path.c_str());
+    } else {
+      blobs.emplace_back(info.st_mtime, path);
+      total += info.st_size;
+    }
+  }
+  std::sort(blobs.begin(), blobs.end());
+  for (const auto& x : blobs) {
+    if (total <= options.blob_budget) break;
+    struct stat info;
+    if (stat(x.second.c_str(), &info) == 0) total -= info.st_size;
+    ::unlink(x.second.c_str());
+  }
+}
+
+// -- chunked uploads --
+std::string upload_file(const std::string& upload_id, const Options& options) {
+  return options.state_dir + "/uploads/" + upload_id + ".json";
+}
+
+void abort_upload(const std::string& upload_id, const Options& options) {
+  uploads.erase(upload_id);
+  ::unlink(upload_file(upload_id, options).c_str());
+}
+
+// appends a chunk of the JSON encoded arguments of a call to a file, the last
+// chunk triggers the call which replies to the request of that chunk
+void receive_chunk(vrpc::json& j,
+                   const std::string& instance,
+                   const vrpc::json& args,
+                   const Options& options) {
+  const std::string upload_id = args[0].get<std::string>();
+  const int index = args[1].get<int>();
+  const int total = args[2].get<int>();
+  if (upload_id.empty() || upload_id.find('/') != std::string::npos) {
+    throw std::runtime_error("Invalid upload id: " + upload_id);
+  }
+  const std::string file = upload_file(upload_id, options);
+  if (index == 0) {
+    // (re-)starts the upload
+    abort_upload(upload_id, options);
+    make_directories(options.state_dir + "/uploads");
+    Upload& upload = uploads[upload_id];
+    upload.next = 0;
+    upload.file.open(file, std::ios::binary | std::ios::trunc);
+  }
+  auto it = uploads.find(upload_id);
+  if (it == uploads.end() || it->second.next != index) {
+    abort_upload(upload_id, options);
+    throw std::runtime_error("Unexpected chunk " + std::to_string(index) +
+                             " of upload " + upload_id);
+  }
+  Upload& upload = it->second;
+  const std::string data = decode_base64(args[3].get<std::string>());
+  upload.sha1.process_bytes(data.data(), data.size());
+  upload.file.write(data.data(), data.size());
+  if (!upload.file) {
+    abort_upload(upload_id, options);
+    throw std::runtime_error("Failed writing upload " + upload_id);
+  }
+  upload.next = index + 1;
+  upload.updated = std::time(nullptr);
+  if (upload.next < total) {
+    j["r"] = {{"received", index}};
+    reply(j);
+    return;
+  }
+  // the last chunk names the function and optionally carries the checksum
+  upload.file.close();
+  const std::string digest = hex_digest(upload.sha1);
+  uploads.erase(it);
+  if (args.size() > 5 && args[5].get<std::string>() != digest) {
+    ::unlink(file.c_str());
+    throw std::runtime_error("Checksum mismatch of upload " + upload_id);
+  }
+  call_r_function_file(j, args[4].get<std::string>(), file, instance);
+}
+
+// removes uploads that were abandoned by their client
+void purge_uploads(const Options& options) {
+  const std::time_t expired = std::time(nullptr) - options.blob_ttl;
+  std::vector<std::string> abandoned;
+  for (const auto& x : uploads) {
+    if (x.second.updated < expired) abandoned.push_back(x.first);
+  }
+  for (const auto& x : abandoned) abort_upload(x, options);
+}
+
+void schedule_purge(boost::asio::steady_timer& timer, const Options& options) {
+  timer.expires_after(1min);
+  timer.async_wait([&](const boost::system::error_code& ec) {
+    if (ec) return;
+    run_on_r([&]() {
+      purge_jobs(options);
+      purge_blobs(options);
+      purge_uploads(options);
+    });
+    schedule_purge(timer, options);
+  });
+}
+
+// publishes output forwarded from a detached R evaluation, the topic ends
+// with the id of the original request
+void publish_output(int id, const std::string& output, const Options& options) {
+  auto it = awaited_callbacks.find(id);
+  if (it == awaited_callbacks.end()) return;
+  const vrpc::json& j = it->second;
+  std::string request_id = std::to_string(id);
+  if (j.contains("i")) {
+    request_id = j["i"].is_string() ? j["i"].get<std::string>() : j["i"].dump();
+  }
+  mqtt_publish(options.domain + "/" + options.agent + "/__log__/" + request_id,
+               output, mqtt::qos::at_most_once);
+}
+
+// replies (or continues) a call without dispatching further calls
+void complete_call(int id, const std::string& ret) {
+  finish_call(id);
+  auto it = awaited_callbacks.find(id);
+  if (it == awaited_callbacks.end()) return;
+  vrpc::json j = std::move(it->second);
+  awaited_callbacks.erase(it);
   if (ret.size() >= 7 && ret.substr(0, 7) == "__err__") {
     j["e"] = ret.substr(7);
   } else {
@@ -222,33 +1742,269 @@ void on_execution_done(int id, const Rcpp::CharacterVector& cv) {
       j["r"] = ret;
     }
   }
-  client->publish(j["s"].get<std::string>(), j.dump(),
-                  mqtt::qos::at_least_once);
+  auto continuation = continuations.find(id);
+  if (continuation != continuations.end()) {
+    const auto handler = std::move(continuation->second);
+    continuations.erase(continuation);
+    handler(j);
+    return;
+  }
+  reply(j);
+}
+
+// processes the result of a detached R evaluation (see `on_execution_done`)
+void handle_execution_result(int id, const std::string& ret) {
+  complete_call(id, ret);
+  dispatch_calls();
+}
+
+// -- native functions --
+// C-callable behind `vrpc::register_native`, named distinctly so that calls
+// within this library never resolve to the header's wrapper
+void register_native_function(const char* name,
+                              vrpc::native_function function,
+                              int pooled) {
+  {
+    std::lock_guard<std::mutex> lock(native_functions_mutex);
+    native_functions[name] = {function, pooled != 0};
+  }
+  if (native_registered_handler) native_registered_handler(name);
+}
+
+// replies the result of a native function, pooled ones are run off the agent's
+// thread and replied from it
+void call_native(vrpc::json& j,
+                 const NativeFunction& native,
+                 boost::asio::io_context& ioc) {
+  const auto run = [](vrpc::json& j, vrpc::native_function function) {
+    try {
+      j["r"] = function(j["a"]);
+    } catch (const std::exception& e) {
+      j["e"] = "Error while calling remote function: " + std::string(e.what());
+    }
+  };
+  if (!native.pooled || !native_pool) {
+    run(j, native.function);
+    reply(j);
+    return;
+  }
+  boost::asio::post(*native_pool, [j, run, function = native.function,
+                                   &ioc]() mutable {
+    run(j, function);
+    boost::asio::post(ioc, [j = std::move(j)]() { reply(j); });
+  });
+}
+
+std::vector<double> numeric_values(const vrpc::json& x) {
+  std::vector<double> values;
+  values.reserve(x.size());
+  for (const auto& value : x) {
+    if (value.is_number()) values.push_back(value.get<double>());
+  }
+  return values;
+}
+
+// equally wide bins over the range of the (numeric) values of the first
+// argument, the second argument is the number of bins
+vrpc::json native_histogram(const vrpc::json& args) {
+  const auto values = numeric_values(args.at(0));
+  const int bins = args.size() > 1 ? args[1].get<int>() : 10;
+  if (values.empty() || bins < 1) {
+    throw std::runtime_error("Need values and a positive number of bins");
+  }
+  const auto range = std::minmax_element(values.begin(), values.end());
+  const double min = *range.first;
+  const double width = (std::max(*range.second, min + 1e-12) - min) / bins;
+  std::vector<double> breaks(bins + 1);
+  for (int i = 0; i <= bins; ++i) breaks[i] = min + i * width;
+  std::vector<int> counts(bins, 0);
+  for (const auto x : values) {
+    ++counts[std::min(bins - 1, static_cast<int>((x - min) / width))];
+  }
+  return {{"breaks", breaks}, {"counts", counts}};
+}
+
+// summary statistics of the (numeric) values of the first argument, quantiles
+// are interpolated as by R's default
+vrpc::json native_summary(const vrpc::json& args) {
+  auto values = numeric_values(args.at(0));
+  if (values.empty()) throw std::runtime_error("Need values");
+  std::sort(values.begin(), values.end());
+  const std::size_t n = values.size();
+  const auto quantile = [&](double p) {
+    const double h = (n - 1) * p;
+    const std::size_t k = static_cast<std::size_t>(h);
+    if (k + 1 >= n) return values[n - 1];
+    return values[k] + (h - k) * (values[k + 1] - values[k]);
+  };
+  double mean = 0;
+  for (const auto x : values) mean += x;
+  mean /= n;
+  double sd = 0;
+  for (const auto x : values) sd += (x - mean) * (x - mean);
+  sd = n > 1 ? std::sqrt(sd / (n - 1)) : 0;
+  return {{"n", n},
+          {"min", values[0]},
+          {"q1", quantile(0.25)},
+          {"median", quantile(0.5)},
+          {"mean", mean},
+          {"q3", quantile(0.75)},
+          {"max", values[n - 1]},
+          {"sd", sd}};
+}
+
+// [[Rcpp::init]]
+void init_native_functions(DllInfo* dll) {
+  R_RegisterCCallable("vrpc", "register_native_function",
+                      reinterpret_cast<DL_FUNC>(register_native_function));
+  register_native_function("native_histogram", native_histogram, 1);
+  register_native_function("native_summary", native_summary, 1);
 }
 
 // [[Rcpp::export]]
-void start_vrpc_agent(const Rcpp::List& args) {
-  // this function is implemented in R (Adapter.R) and we will call it from C++
-  Rcpp::Function vrpc_call("vrpc_call");
+void on_execution_done(int id, const Rcpp::CharacterVector& cv) {
+  // results are sent on the connection used for output forwarding (if any)
+  // to keep them ordered after the output
+  const int fd = agent_connection >= 0 ? agent_connection : connect_to_agent();
+  agent_connection = -1;
+  try {
+    send_to_agent(fd, id, MessageType::result, Rcpp::as<std::string>(cv));
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+}
 
-  // translate the R list into proper C++ struct
-  const Options options = parse_arguments(args);
+// [[Rcpp::export]]
+int lock_session(const std::string& session_dir, bool wait = true) {
+  const std::string path(session_dir + "/.lock");
+  const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open session lock: " + path);
+  }
+  // advisory (fcntl) locks are released with the descriptor and also work on
+  // network file systems, hence on session stores shared between agents
+  struct flock lock {};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (::fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock) != 0) {
+    if (errno == EINTR) continue;
+    const bool busy = errno == EACCES || errno == EAGAIN;
+    ::close(fd);
+    // the agent's own R thread must not wait for a running call
+    if (busy) throw std::runtime_error("Session busy: " + session_dir);
+    throw std::runtime_error("Could not lock session: " + session_dir);
+  }
+  return fd;
+}
 
-  std::cout << "Domain : " << options.domain << std::endl;
-  std::cout << "Agent  : " << options.agent << std::endl;
-  std::cout << "Broker : " << options.host << ":" << options.port << std::endl;
+// [[Rcpp::export]]
+void unlock_session(int fd) {
+  ::close(fd);
+}
 
+// all topics the agent receives requests (or ingested data) on
+std::vector<std::string> agent_topics(const Options& options) {
+  const std::string base_topic(options.domain + "/" + options.agent +
+                               "/Session/__static__/");
+  std::vector<std::string> topics;
+  for (const auto& x :
+       {"__createShared__", "__delete__", "call", "__createTemplate__",
+        "__clone__", "__reload__", "__exportSession__", "__exportChunk__",
+        "__importSession__", "__importChunk__", "__upload__", "__callChunk__",
+        "__map__", "__pipeline__", "__submitJob__", "__jobStatus__",
+        "__jobResult__", "__metrics__"}) {
+    topics.push_back(base_topic + x);
+  }
+  for (const auto& x : options.functions) {
+    topics.push_back(base_topic + x);
+  }
+  {
+    std::lock_guard<std::mutex> lock(native_functions_mutex);
+    for (const auto& x : native_functions) {
+      topics.push_back(base_topic + x.first);
+    }
+  }
+  // instances restored from a previous run of the agent
+  for (const auto& x : instances) {
+    topics.push_back(instance_topic(x, options));
+  }
+  std::lock_guard<std::mutex> lock(ingests_mutex);
+  for (const auto& x : ingests) {
+    topics.push_back(x.second.topic);
+  }
+  return topics;
+}
+
+// forgets everything of a previous run within the same R process (state that
+// persists is restored from the state directory), ids of calls keep counting
+// as results of old evaluations may still arrive
+void reset_agent_state() {
+  agent_status = AgentStatus::online;
+  instances.clear();
+  awaited_callbacks.clear();
+  continuations.clear();
+  jobs.clear();
+  uploads.clear();
+  {
+    std::lock_guard<std::mutex> lock(ingests_mutex);
+    ingests.clear();
+  }
+  call_queue.clear();
+  running_calls.clear();
+  execution_estimates.clear();
+  metrics.requests = 0;
+  metrics.completed = 0;
+  metrics.dropped = 0;
+  spool_bytes = 0;
+  spooled.clear();
+}
+
+// runs the agent until it is shut down, on the thread of the event loop
+void run_agent(Options options) {
   // this reflects the event-loop (asio technology)
   boost::asio::io_context ioc;
+  event_loop = &ioc;
+
+  // calls are evaluated concurrently up to an adaptive limit
+  concurrency_limit.reset(new ConcurrencyLimit(
+      std::max(4u, 2 * std::thread::hardware_concurrency()),
+      options.max_concurrency));
+
+  // threads for pooled native functions
+  if (options.native_threads > 0) {
+    native_pool.reset(new boost::asio::thread_pool(options.native_threads));
+  }
+
+  // results of detached R evaluations arrive here
+  result_socket_path = options.socket;
+  ResultServer result_server(
+      ioc, result_socket_path,
+      [&](const ResultHeader& header, const std::string& payload) {
+        run_on_r([&options, header, payload]() {
+          if (header.type == MessageType::output) {
+            publish_output(header.id, payload, options);
+          } else {
+            handle_execution_result(header.id, payload);
+          }
+        });
+      });
 
   // create no TLS client
-  client = mqtt::make_sync_client(ioc, options.host, options.port);
+  client = mqtt::make_async_client(ioc, options.host, options.port);
   using packet_id_t =
       typename std::remove_reference_t<decltype(*client)>::packet_id_t;
 
   // setup client
   client->set_client_id(generate_client_id(options));
-  client->set_clean_session(true);
+  // the broker keeps subscriptions and queued requests while the agent is
+  // disconnected, unacknowledged replies are resent after reconnecting
+  client->set_clean_session(false);
+  client->set_keep_alive_sec(30);
+  client->set_pingresp_timeout(10s);
+  client->set_max_queue_send_count(max_coalesced_packets);
+  client->set_max_queue_send_size(max_coalesced_bytes);
   client->set_will(
       mqtt::will(mqtt::allocate_buffer(options.domain + "/" + options.agent +
                                        "/__agentInfo__"),
@@ -259,47 +2015,93 @@ void start_vrpc_agent(const Rcpp::List& args) {
                                            .dump()),
                  mqtt::qos::at_least_once | mqtt::retain::yes));
 
+  // reconnects with exponential backoff (0.5s up to 30s, with jitter)
+  boost::asio::steady_timer reconnect_timer(ioc);
+  int reconnect_attempt = 0;
+  bool reconnect_pending = false;
+  std::mt19937 jitter(std::random_device{}());
+  std::function<void()> reconnect = [&]() {
+    if (reconnect_pending) return;
+    reconnect_pending = true;
+    const auto backoff = std::min<std::chrono::milliseconds>(
+        500ms * (1 << std::min(reconnect_attempt, 6)), 30s);
+    ++reconnect_attempt;
+    std::uniform_int_distribution<long> spread(0, backoff.count() / 4);
+    reconnect_timer.expires_after(backoff +
+                                  std::chrono::milliseconds(spread(jitter)));
+    reconnect_timer.async_wait([&](const boost::system::error_code& ec) {
+      reconnect_pending = false;
+      if (ec) return;
+      std::cout << "Reconnecting..." << std::endl;
+      client->async_connect([&](mqtt::error_code ec) {
+        if (ec) {
+          log_mqtt_error("Connect", ec);
+          reconnect();
+        }
+      });
+    });
+  };
+  // reconnects unless the agent is shutting down
+  const auto connection_lost = [&]() {
+    if (agent_status == AgentStatus::offline) {
+      ioc.stop();
+    } else {
+      reconnect();
+    }
+  };
+
   // setup handlers
   client->set_connack_handler(
       [&](bool sp, mqtt::connect_return_code connack_return_code) {
-        if (connack_return_code == mqtt::connect_return_code::accepted) {
-          std::cout << "[OK]" << std::endl;
-          publish_agent_info(client, options);
-          const std::string base_topic(options.domain + "/" + options.agent +
-                                       "/Session/__static__/");
-          client->subscribe(base_topic + "__createShared__",
-                            mqtt::qos::at_least_once);
-          client->subscribe(base_topic + "__delete__",
-                            mqtt::qos::at_least_once);
-          client->subscribe(base_topic + "call", mqtt::qos::at_least_once);
-          for (const auto& x : options.functions) {
-            client->subscribe(base_topic + x, mqtt::qos::at_least_once);
-          }
-          publish_class_info(client, options);
+        if (connack_return_code != mqtt::connect_return_code::accepted) {
+          std::cout << "Connection refused: "
+                    << mqtt::connect_return_code_to_str(connack_return_code)
+                    << std::endl;
+          // the broker closes the connection, retried with backoff
+          return true;
         }
+        std::cout << "[OK]" << std::endl;
+        reconnect_attempt = 0;
+        drain_spool();
+        // subscriptions of a kept session may miss topics added meanwhile,
+        // hence all are (re)subscribed at once
+        run_on_r([&]() {
+          publish_agent_info(options);
+          subscribe_batched(agent_topics(options));
+          publish_class_info(options);
+        });
         return true;
       });
-  client->set_close_handler([]() { std::cout << "closed." << std::endl; });
-  client->set_error_handler([](mqtt::error_code ec) {
+  client->set_close_handler([&]() {
+    std::cout << "closed." << std::endl;
+    connection_lost();
+  });
+  client->set_error_handler([&](mqtt::error_code ec) {
     std::cout << "error: " << ec.message() << std::endl;
+    connection_lost();
   });
-  client->set_publish_handler([&](mqtt::optional<packet_id_t> packet_id,
-                                  mqtt::publish_options pubopts,
-                                  mqtt::buffer topic, mqtt::buffer contents) {
+  // processes requests on R's thread, the payload was parsed already
+  const auto handle_message = [&](const std::string& topic, vrpc::json j,
+                                  std::int64_t received) {
     // std::cout << "message received." << std::endl;
     // std::cout << "topic: " << topic << std::endl;
-    // std::cout << "contents: " << contents << std::endl;
+    // std::cout << "contents: " << j.dump() << std::endl;
     const auto tokens = tokenize(std::string(topic), "/");
     if (tokens.size() == 4 && tokens[3] == "__clientInfo__") {
       // std::cout << "received clientInfo" << std::endl;
-      return true;
+      return;
     }
     if (tokens.size() != 5) {
       std::cout << "Received message with invalid topic URI" << std::endl;
-      return true;
+      return;
+    }
+    if (!j.is_object()) {
+      std::cout << "Received message with invalid payload" << std::endl;
+      return;
     }
-    auto j = vrpc::json::parse(std::string(contents));
+    ++metrics.requests;
     try {
+      check_deadline(j, received);
       // extract RPC information from topic structure
       const std::string class_name = tokens[2];
       const std::string instance = tokens[3];
@@ -309,95 +2111,478 @@ void start_vrpc_agent(const Rcpp::List& args) {
       j["c"] = instance == "__static__" ? class_name : instance;
       j["f"] = function;
 
-      // register next asynchronous R call
-      call_id++;
-      awaited_callbacks[call_id] = j;
-
       // RPC arguments
       vrpc::json args = j["a"];
 
       // -- static function --
       if (instance == "__static__") {
-        if (function == "call") {
-          // generic call, first argument encodes R function name
-          std::string r_function = args[0];
-          vrpc::json r_args(vrpc::json::array());
-          for (size_t i = 1; i < args.size(); ++i) {
-            r_args.push_back(args[i]);
-          }
-          vrpc_call(r_function, r_args.dump(), call_id);
-        } else if (function == "__createShared__") {
+        if (function == "__createShared__") {
           // instance creation, first argument encodes instance name
-          // instances will always be of Session class, further args are ignored
+          // instances will always be of Session class, further args are passed
+          // to the init function (if configured) evaluated in the new session
+          // sessions already existing in the store (e.g. served by another
+          // agent before) are taken over as they are
           const std::string new_instance = args[0].get<std::string>();
-          client->subscribe(options.domain + "/" + options.agent + "/Session/" +
-                                new_instance + "/+",
-                            mqtt::qos::at_least_once);
-          instances.push_back(new_instance);
-          publish_class_info(client, options);
-          j["r"] = new_instance;
-          client->publish(j["s"].get<std::string>(), j.dump(),
-                          mqtt::qos::at_least_once);
+          if (options.init.empty() ||
+              Rcpp::as<bool>(call_r_internal("session_exists", new_instance))) {
+            register_instance(new_instance, options);
+            j["r"] = new_instance;
+            reply(j);
+          } else {
+            const int id = call_r_function(
+                j, options.init, vrpc::json(args.begin() + 1, args.end()),
+                new_instance);
+            continuations[id] = [new_instance, &options](vrpc::json& j) {
+              if (j.contains("e")) {
+                // the snapshot of a failed init must not be taken over by a
+                // retried creation, the init error is replied in any case
+                try {
+                  call_r_internal("remove_session", new_instance);
+                } catch (const std::exception& e) {
+                  std::cout << "Could not remove session " << new_instance
+                            << ": " << e.what() << std::endl;
+                }
+              } else {
+                register_instance(new_instance, options);
+                j["init"] = std::move(j["r"]);
+                j["r"] = new_instance;
+              }
+              reply(j);
+            };
+          }
         } else if (function == "__delete__") {
           // instance deletion, first argument encodes instance name
           const std::string del_instance = args[0].get<std::string>();
-          client->unsubscribe(options.domain + "/" + options.agent +
-                              "/Session/" + del_instance + "/+");
-          auto it = std::find(std::begin(instances), std::end(instances),
-                              del_instance);
-          if (it != std::end(instances)) {
-            instances.erase(it);
-            publish_class_info(client, options);
-            j["r"] = true;
-            client->publish(j["s"].get<std::string>(), j.dump(),
-                            mqtt::qos::at_least_once);
+          j["r"] = unregister_instance(del_instance, options);
+          reply(j);
+        } else if (function == "__createTemplate__") {
+          // template creation, arguments are template name, R function and
+          // the arguments of that function
+          const std::string name = args[0].get<std::string>();
+          call_r_function(j, args[1], vrpc::json(args.begin() + 2, args.end()),
+                          VRPC_TEMPLATE_PREFIX + name);
+        } else if (function == "__clone__") {
+          // instance creation from a template or another instance, arguments
+          // are the new instance name and the name of the source
+          const std::string new_instance = args[0].get<std::string>();
+          const std::string source = args[1].get<std::string>();
+          if (std::find(std::begin(instances), std::end(instances),
+                        new_instance) != std::end(instances)) {
+            throw std::runtime_error("Instance already exists: " +
+                                     new_instance);
+          }
+          const bool is_instance =
+              std::find(std::begin(instances), std::end(instances), source) !=
+              std::end(instances);
+          call_r_internal("clone_session",
+                          is_instance ? source : VRPC_TEMPLATE_PREFIX + source,
+                          new_instance);
+          register_instance(new_instance, options);
+          j["r"] = new_instance;
+          reply(j);
+        } else if (function == "__exportSession__") {
+          // packages a session for migration and stops serving it, arguments
+          // are the instance name and an optional (shared) target path
+          const std::string session = args[0].get<std::string>();
+          // no further calls are accepted while the session is packaged
+          mqtt_unsubscribe(instance_topic(session, options));
+          vrpc::json manifest;
+          try {
+            manifest = vrpc::json::parse(Rcpp::as<std::string>(
+                args.size() > 1 ? call_r_internal("export_session", session,
+                                                  args[1].get<std::string>())
+                                : call_r_internal("export_session", session)));
+          } catch (...) {
+            if (std::find(std::begin(instances), std::end(instances),
+                          session) != std::end(instances)) {
+              mqtt_subscribe(instance_topic(session, options));
+            }
+            throw;
+          }
+          unregister_instance(session, options);
+          j["r"] = manifest;
+          reply(j);
+        } else if (function == "__exportChunk__") {
+          // base64 encoded chunk of an export, arguments are session and index
+          j["r"] = Rcpp::as<std::string>(call_r_internal(
+              "read_export_chunk", args[0].get<std::string>(),
+              args[1].get<int>()));
+          reply(j);
+        } else if (function == "__importSession__") {
+          // restores an exported session from a (shared) path, arguments are
+          // the instance name, the path and an optional md5 checksum
+          const std::string session = args[0].get<std::string>();
+          const std::string path = args[1].get<std::string>();
+          if (args.size() > 2) {
+            call_r_internal("import_session", session, path,
+                            args[2].get<std::string>());
           } else {
-            j["r"] = false;
-            client->publish(j["s"].get<std::string>(), j.dump(),
-                            mqtt::qos::at_least_once);
+            call_r_internal("import_session", session, path);
           }
+          register_instance(session, options);
+          j["r"] = session;
+          reply(j);
+        } else if (function == "__importChunk__") {
+          // restores an exported session transferred in chunks, arguments are
+          // instance name, chunk index, number of chunks, base64 encoded data
+          // and the md5 checksum of the export
+          const std::string session = args[0].get<std::string>();
+          const int index = args[1].get<int>();
+          const bool complete = Rcpp::as<bool>(call_r_internal(
+              "write_import_chunk", session, index, args[2].get<int>(),
+              args[3].get<std::string>(), args[4].get<std::string>()));
+          if (complete) register_instance(session, options);
+          j["r"] = {{"received", index}, {"complete", complete}};
+          reply(j);
+        } else if (function == "__reload__") {
+          // hot reload of all function definitions of the source file
+          j["r"] = reload_functions(options);
+          reply(j);
+        } else if (function == "__upload__") {
+          // content addressed upload, the hash references the data later on
+          const std::string hash = sha1_hex(args[0].dump());
+          if (::utime(blob_file(hash, options).c_str(), nullptr) == 0) {
+            // already known, refreshing its last use is sufficient
+            j["r"] = hash;
+            reply(j);
+          } else {
+            call_r_function(j, "store_blob", vrpc::json{hash, args[0]});
+          }
+        } else if (function == "__callChunk__") {
+          receive_chunk(j, "", args, options);
+        } else if (function == "__map__") {
+          // parallel map, arguments are function name, list and chunk size
+          call_r_function(j, "map_parallel", args);
+        } else if (function == "__submitJob__") {
+          // job submission, first argument encodes the function to run
+          j["r"] = submit_job("", args, options);
+          reply(j);
+        } else if (function == "__jobStatus__") {
+          const std::string job_id = args[0].get<std::string>();
+          auto it = jobs.find(job_id);
+          if (it == jobs.end()) {
+            throw std::runtime_error("Unknown job: " + job_id);
+          }
+          j["r"] = job_info(job_id, it->second);
+          reply(j);
+        } else if (function == "__jobResult__") {
+          request_job_result(j, args[0].get<std::string>(), options);
+        } else if (function == "__metrics__") {
+          j["r"] = {{"requests", metrics.requests.load()},
+                    {"completed", metrics.completed.load()},
+                    {"dropped", metrics.dropped.load()},
+                    {"queued", call_queue.size()},
+                    {"running", running_calls.size()},
+                    {"concurrencyLimit", concurrency_limit->value()}};
+          reply(j);
         } else {
-          // specific function call
-          vrpc_call(function, args.dump(), call_id);
+          // generic, specific or pipeline (`__pipeline__`) function call
+          call_r_function(j, function, args);
         }
       } else {
         // -- member function --
-        if (function == "call") {
-          // generic call, first argument encodes R function name
-          std::string r_function = args[0];
-          vrpc::json r_args(vrpc::json::array());
-          for (size_t i = 1; i < args.size(); ++i) {
-            r_args.push_back(args[i]);
+        if (function == "__ingest__") {
+          // streams rows published on a topic into a data frame of the
+          // session, arguments are the topic and the name of the data frame
+          register_ingest(instance, args[0].get<std::string>(),
+                          args.size() > 1 ? args[1].get<std::string>()
+                                          : std::string("ingest"),
+                          options);
+          j["r"] = true;
+          reply(j);
+        } else if (function == "__flush__") {
+          // appends the buffered rows to the data frame right away
+          std::string name;
+          {
+            std::lock_guard<std::mutex> lock(ingests_mutex);
+            auto it = ingests.find(instance);
+            if (it == ingests.end()) {
+              throw std::runtime_error("No data is ingested into " + instance);
+            }
+            name = it->second.name;
           }
-          vrpc_call(r_function, r_args.dump(), call_id, instance);
+          const std::size_t rows = flush_ingest(instance);
+          const int id =
+              call_r_function(j, "exists", vrpc::json{name}, instance);
+          continuations[id] = [rows](vrpc::json& j) {
+            if (!j.contains("e")) j["r"] = rows;
+            reply(j);
+          };
         } else {
-          vrpc_call(function, args.dump(), call_id, instance);
+          // buffered rows are part of the session from the next call on
+          flush_ingest(instance);
+          if (function == "__submitJob__") {
+            j["r"] = submit_job(instance, args, options);
+            reply(j);
+          } else if (function == "__callChunk__") {
+            receive_chunk(j, instance, args, options);
+          } else {
+            call_r_function(j, function, args, instance);
+          }
         }
       }
     } catch (const std::exception& e) {
       j["e"] = "Error while calling remote function: " + std::string(e.what());
-      client->publish(j["s"].get<std::string>(), j.dump(),
-                      mqtt::qos::at_least_once);
+      reply(j);
     };
+  };
+  // serves native functions on the thread of the event loop
+  const auto handle_native = [&](const std::string& topic, vrpc::json& j,
+                                 std::int64_t received) {
+    const auto tokens = tokenize(topic, "/");
+    if (tokens.size() != 5 || tokens[3] != "__static__") return false;
+    NativeFunction native{};
+    {
+      std::lock_guard<std::mutex> lock(native_functions_mutex);
+      const auto it = native_functions.find(tokens[4]);
+      if (it == native_functions.end()) return false;
+      native = it->second;
+    }
+    if (!j.is_object()) return false;
+    ++metrics.requests;
+    try {
+      check_deadline(j, received);
+      j["c"] = tokens[2];
+      j["f"] = tokens[4];
+      call_native(j, native, ioc);
+    } catch (const std::exception& e) {
+      j["e"] = "Error while calling remote function: " + std::string(e.what());
+      reply(j);
+    }
+    return true;
+  };
+  client->set_publish_handler([&](mqtt::optional<packet_id_t> packet_id,
+                                  mqtt::publish_options pubopts,
+                                  mqtt::buffer topic, mqtt::buffer contents) {
+    const std::int64_t received = now_ms();
+    auto j = vrpc::json::parse(contents.begin(), contents.end(), nullptr, false);
+    // ingested data and native functions need no R
+    if (ingest_message(std::string(topic), j, options) ||
+        handle_native(std::string(topic), j, received)) {
+      return true;
+    }
+    run_on_r([&handle_message, topic = std::string(topic), j = std::move(j),
+              received]() mutable {
+      handle_message(topic, std::move(j), received);
+    });
     return true;
   });
 
+  // restore instances of a previous run
+  run_on_r_sync([&]() {
+    make_directories(options.state_dir);
+    restore_instances(options);
+    restore_ingests(options);
+  });
+  restore_spool(options);
+
   // Connect
-  client->connect();
-
-  // Disconnect (Ctrl-C)
-  shutdown_handler = [&]() {
-    client->publish(options.domain + "/" + options.agent + "/__agentInfo__",
-                    vrpc::json{{"status", "offline"},
-                               {"hostname", get_hostname()},
-                               {"v", VRPC_PROTOCOL_VERSION}}
-                        .dump(),
-                    mqtt::qos::at_least_once | mqtt::retain::yes);
-    client->disconnect(3s);
+  client->async_connect([&](mqtt::error_code ec) {
+    if (ec) {
+      log_mqtt_error("Connect", ec);
+      reconnect();
+    }
+  });
+
+  // re-run unfinished jobs and expire old jobs and blobs
+  run_on_r([&]() { restore_jobs(options); });
+  boost::asio::steady_timer purge_timer(ioc);
+  schedule_purge(purge_timer, options);
+
+  // adapt the concurrency limit and publish it when changed
+  boost::asio::steady_timer limit_timer(ioc);
+  int published_limit = concurrency_limit->value();
+  std::function<void()> schedule_limit_refresh = [&]() {
+    limit_timer.expires_after(5s);
+    limit_timer.async_wait([&](const boost::system::error_code& ec) {
+      if (ec) return;
+      run_on_r([&]() {
+        concurrency_limit->refresh();
+        reap_lost_calls();
+        dispatch_calls();
+        if (concurrency_limit->value() != published_limit) {
+          published_limit = concurrency_limit->value();
+          publish_agent_info(options);
+        }
+      });
+      schedule_limit_refresh();
+    });
+  };
+  schedule_limit_refresh();
+
+  // watch the source file for changes
+  boost::asio::steady_timer watch_timer(ioc);
+  if (options.watch > 0 && !options.source.empty()) {
+    schedule_source_watch(watch_timer, options,
+                          modification_time(options.source));
+  }
+
+  // Disconnect
+  const auto shutdown = [&]() {
+    if (agent_status == AgentStatus::offline) return;
+    agent_status = AgentStatus::offline;
+    mqtt_publish(options.domain + "/" + options.agent + "/__agentInfo__",
+                 vrpc::json{{"status", "offline"},
+                            {"hostname", get_hostname()},
+                            {"v", VRPC_PROTOCOL_VERSION}}
+                     .dump(),
+                 mqtt::qos::at_least_once | mqtt::retain::yes);
+    run_on_io([&]() {
+      reconnect_timer.cancel();
+      if (!client->connected()) {
+        ioc.stop();
+        return;
+      }
+      client->async_disconnect(
+          3s, [](mqtt::error_code ec) { log_mqtt_error("Disconnect", ec); });
+    });
+  };
+
+  // Drain (SIGTERM, Ctrl-C, `stop_vrpc_agent`): stops accepting requests,
+  // lets accepted calls finish for up to `drain_timeout` seconds and
+  // disconnects, a second signal disconnects immediately. In background mode
+  // Ctrl-C is left to the R console.
+  static const int atfork = ::pthread_atfork(nullptr, nullptr, restore_signals);
+  (void)atfork;
+  ::sigaction(SIGTERM, nullptr, &previous_sigterm);
+  sigterm_saved = true;
+  if (!options.background) {
+    ::sigaction(SIGINT, nullptr, &previous_sigint);
+    sigint_saved = true;
+  }
+  // the signal set resets the dispositions to default when destroyed, hence
+  // they are restored afterwards
+  struct SignalsRestorer {
+    ~SignalsRestorer() {
+      restore_signals();
+      sigterm_saved = false;
+      sigint_saved = false;
+    }
+  } signals_restorer;
+  boost::asio::signal_set signals(ioc, SIGTERM);
+  if (!options.background) signals.add(SIGINT);
+  boost::asio::steady_timer drain_timer(ioc);
+  std::int64_t drain_deadline = 0;
+  std::function<void()> wait_for_drain = [&]() {
+    if (agent_status == AgentStatus::offline) return;
+    if ((awaited_callbacks.empty() && call_queue.empty()) ||
+        now_ms() > drain_deadline) {
+      run_on_io([&]() { signals.cancel(); });
+      shutdown();
+      return;
+    }
+    run_on_io([&]() {
+      drain_timer.expires_after(100ms);
+      drain_timer.async_wait([&](const boost::system::error_code& ec) {
+        if (!ec) run_on_r(wait_for_drain);
+      });
+    });
   };
-  std::signal(SIGINT, [](int) { shutdown_handler(); });
-  std::signal(SIGKILL, [](int) { shutdown_handler(); });
+  const auto drain = [&]() {
+    if (agent_status != AgentStatus::online) return;
+    std::cout << "Draining..." << std::endl;
+    agent_status = AgentStatus::draining;
+    for (const auto& x : agent_topics(options)) mqtt_unsubscribe(x);
+    publish_agent_info(options);
+    // buffered data becomes part of the sessions
+    flush_ingests();
+    drain_deadline = now_ms() + options.drain_timeout * 1000;
+    wait_for_drain();
+  };
+  run_on_r([&]() {
+    drain_handler = drain;
+    native_registered_handler = [&](const std::string& name) {
+      if (agent_status != AgentStatus::online) return;
+      mqtt_subscribe(options.domain + "/" + options.agent +
+                     "/Session/__static__/" + name);
+      publish_class_info(options);
+    };
+  });
+  signals.async_wait([&](const boost::system::error_code& ec, int) {
+    if (ec) return;
+    run_on_r(drain);
+    signals.async_wait([&](const boost::system::error_code& ec, int) {
+      if (ec) return;
+      drain_timer.cancel();
+      run_on_r(shutdown);
+    });
+  });
 
   // Start event loop
   ioc.run();
+  // lets R finish what was handed over
+  run_on_r_sync([]() {
+    drain_handler = nullptr;
+    native_registered_handler = nullptr;
+    // continuations refer to this run
+    reset_agent_state();
+  });
+  event_loop = nullptr;
+  if (native_pool) native_pool->join();
+}
+
+// [[Rcpp::export]]
+void start_vrpc_agent(const Rcpp::List& args) {
+  // translate the R list into proper C++ struct
+  Options options = parse_arguments(args);
+  if (io_thread.joinable()) Rcpp::stop("Agent is already running");
+
+  std::cout << "Domain : " << options.domain << std::endl;
+  std::cout << "Agent  : " << options.agent << std::endl;
+  std::cout << "Broker : " << options.host << ":" << options.port << std::endl;
+
+  if (::pipe(r_tasks_pipe) != 0) {
+    Rcpp::stop(std::string("Failed creating pipe: ") + std::strerror(errno));
+  }
+  ::fcntl(r_tasks_pipe[0], F_SETFL, O_NONBLOCK);
+  ::fcntl(r_tasks_pipe[1], F_SETFL, O_NONBLOCK);
+  agent_pid = ::getpid();
+  reset_agent_state();
+  agent_running = true;
+  agent_error = nullptr;
+  // in background mode R's event loop runs the handed over tasks whenever R
+  // is idle (console prompt, Sys.sleep, ...)
+  if (options.background) {
+    r_tasks_handler =
+        addInputHandler(R_InputHandlers, r_tasks_pipe[0], run_r_tasks, 42);
+  }
+  io_thread = std::thread([options]() {
+    try {
+      run_agent(options);
+    } catch (const std::exception& e) {
+      // foreground agents rethrow it on R's thread
+      if (options.background) {
+        std::cout << "Agent failed: " << e.what() << std::endl;
+      }
+      agent_error = std::current_exception();
+    }
+    // the last task, cleans up on R's thread
+    run_on_r([]() {
+      if (r_tasks_handler) {
+        removeInputHandler(&R_InputHandlers, r_tasks_handler);
+        r_tasks_handler = nullptr;
+      }
+      io_thread.join();
+      ::close(r_tasks_pipe[0]);
+      ::close(r_tasks_pipe[1]);
+      agent_running = false;
+    });
+  });
+  if (options.background) return;
+
+  // otherwise R's thread waits for tasks until the agent is stopped
+  while (agent_running) {
+    pollfd fd{r_tasks_pipe[0], POLLIN, 0};
+    if (::poll(&fd, 1, -1) < 0 && errno != EINTR) {
+      Rcpp::stop(std::string("Failed waiting: ") + std::strerror(errno));
+    }
+    run_r_tasks(nullptr);
+  }
+  if (agent_error) std::rethrow_exception(agent_error);
+}
+
+// [[Rcpp::export]]
+void stop_vrpc_agent() {
+  if (!drain_handler) Rcpp::stop("No agent is running");
+  drain_handler();
 }